@@ -0,0 +1,67 @@
+// appends a synthetic section of a few hundred MB to a vector and to ChunkedBytes, comparing time and peak RSS
+// g++ -O2 -std=c++17 -Iinclude bench/chunked_bytes.cpp src/chunked_bytes.cpp -o chunked_bytes_bench
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "chunked_bytes.h"
+
+using namespace std;
+
+const size_t total = 400ul << 20;
+
+// instruction sized pieces, like what the encoder appends
+const uint8_t piece[] = { 0x48, 0x8b, 0x44, 0x24, 0x08, 0x48, 0x01, 0xc8, 0xc3 };
+
+template <typename F>
+void run(const char* name, F append)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        auto start = chrono::steady_clock::now();
+        size_t size = append();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        printf("%-14s %6zu MB in %8.1f ms, peak rss %6ld MB\n", name, size >> 20, ms, usage.ru_maxrss >> 10);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    waitpid(pid, nullptr, 0);
+}
+
+int main()
+{
+    run("vector", []()
+    {
+        vector<uint8_t> bytes;
+
+        while (bytes.size() < total)
+            bytes.insert(bytes.end(), piece, piece + sizeof(piece));
+
+        return bytes.size();
+    });
+
+    run("chunked_bytes", []()
+    {
+        ChunkedBytes bytes;
+
+        while (bytes.size() < total)
+            bytes.append(piece, sizeof(piece));
+
+        return bytes.size();
+    });
+
+    return 0;
+}
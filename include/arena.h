@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// hands out objects from large blocks, they never move and are all destroyed with the arena
+template <typename T, size_t block_size = 1024>
+struct Arena
+{
+    std::vector<T*> blocks;
+    size_t used = block_size;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            size_t count = (i + 1 == blocks.size()) ? used : block_size;
+
+            for (size_t j = 0; j < count; j++)
+                blocks[i][j].~T();
+
+            ::operator delete(blocks[i]);
+        }
+    }
+
+    T* alloc()
+    {
+        if (used == block_size)
+        {
+            blocks.push_back((T*)::operator new(sizeof(T) * block_size));
+            used = 0;
+        }
+
+        return new (blocks.back() + used++) T();
+    }
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// byte storage that grows by adding chunks, so appending never moves what is already there
+// chunks double in size from 1 << min_shift up to 1 << max_shift and then stay there
+struct ChunkedBytes
+{
+    static const int min_shift = 8;
+    static const int max_shift = 20;
+
+    std::vector<std::unique_ptr<uint8_t[]>> chunks;
+    size_t length = 0;
+
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+
+    static size_t chunk_capacity(size_t index);
+    static size_t chunk_start(size_t index);
+    static void locate(size_t offset, size_t& index, size_t& within);
+
+    void push_back(uint8_t byte);
+    void append(const uint8_t* data, size_t count);
+    void append(size_t count, uint8_t byte);
+    void append(const ChunkedBytes& other, size_t from, size_t to);
+    void repeat(size_t from, size_t copies);
+
+    void write(size_t offset, const uint8_t* data, size_t count);
+    void read(size_t offset, uint8_t* data, size_t count) const;
+    uint8_t operator[](size_t offset) const;
+
+    size_t chunk_count() const;
+    const uint8_t* chunk_data(size_t index) const;
+    size_t chunk_size(size_t index) const;
+
+    void swap(ChunkedBytes& other);
+    void clear();
+    void release(size_t offset);
+    void truncate(size_t offset);
+
+private:
+    uint8_t* reserve(size_t& count);
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "expr.h"
+
+struct Output;
+
+struct Directive
+{
+    std::string name;
+    std::vector<Constant> args;
+    std::vector<std::vector<std::string>> qualifiers;   // words after arg:, like global sym:hidden
+};
+
+bool is_directive(const std::string& name);
+void apply_directive(Output& out, const Directive& dir);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+struct Output;
+
+// .debug_line from the line rows of the sections, plus the compile unit in .debug_info that points to it
+void add_debug_lines(Output& out, const std::string& source_name, const std::string& comp_dir);
+
+// a cie and one fde per frame in .eh_frame, from the cfi directives or the frames found by -fauto-cfi
+void add_eh_frame(Output& out);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "instruction.h"
+
+struct Output;
+
+bool encode(Output& out, const Instruction& inst);
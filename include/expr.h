@@ -6,9 +6,11 @@
 struct Constant
 {
     std::string symbol;
+    std::string minus;      // symbol that is subtracted, for label differences
     int64_t offset = 0;
 
     bool is_symbolic() const;
+    bool is_difference() const;
 
     Constant operator+(const Constant& other) const;
     Constant operator-(const Constant& other) const;
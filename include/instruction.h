@@ -13,6 +13,7 @@ struct Operand
     int reg;
 
     int32_t disp;
+    uint8_t segment;        // override prefix, 0 if none
     bool address_override;
     bool is_relative;
     bool is_sib;
@@ -22,6 +23,7 @@ struct Operand
 
     uint64_t imm;
     std::string symbol;
+    std::string wrt;        // relocation kind asked for with wrt, like ..gotpcrel or ..plt
 };
 
 struct Instruction
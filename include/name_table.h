@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+// open addressing hash table from names to objects that have a name member and outlive the table
+template <typename T>
+struct NameTable
+{
+    struct Slot
+    {
+        uint64_t hash;
+        T* item;
+    };
+
+    std::vector<Slot> slots = std::vector<Slot>(64, { 0, nullptr });
+    size_t count = 0;
+
+    static uint64_t hash_of(std::string_view name)
+    {
+        return std::hash<std::string_view>()(name);
+    }
+
+    T* find(std::string_view name) const
+    {
+        uint64_t hash = hash_of(name);
+        size_t mask = slots.size() - 1;
+
+        for (size_t i = hash & mask; slots[i].item; i = (i + 1) & mask)
+            if (slots[i].hash == hash && slots[i].item->name == name)
+                return slots[i].item;
+
+        return nullptr;
+    }
+
+    // the name must not be in the table yet
+    void insert(T* item)
+    {
+        if (2 * (count + 1) > slots.size())
+            grow();
+
+        place({ hash_of(item->name), item });
+        count++;
+    }
+
+    void place(const Slot& slot)
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = slot.hash & mask;
+
+        while (slots[i].item)
+            i = (i + 1) & mask;
+
+        slots[i] = slot;
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old(2 * slots.size(), { 0, nullptr });
+        old.swap(slots);
+
+        for (auto& slot : old)
+            if (slot.item)
+                place(slot);
+    }
+};
@@ -1,23 +1,37 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <string>
 #include <vector>
 #include <stdexcept>
 
+#include "tuning.h"
+#include "chunked_bytes.h"
+#include "arena.h"
+#include "name_table.h"
+
 struct Symbol;
 struct Section;
 struct Relocation;
+struct Fragment;
 
 struct Symbol
 {
     std::string name;
     Section* section;
     size_t offset;
+    size_t fragment = 0;    // fragments in front of the symbol until layout
+    uint32_t index = 0;     // in the symbol table, set by the writer
+    uint8_t visibility = 0; // STV_*, st_other in the symbol table
+    uint8_t type = 0;       // STT_*, only function and object are set by the source
+    uint64_t size = 0;
+    bool has_size = false;
 
     bool is_defined = false;
     bool is_exported = false;
     bool is_imported = false;
+    bool is_tls = false;    // defined in a tls section or referenced through a tls relocation
 };
 
 struct SectionAttributes
@@ -27,14 +41,166 @@ struct SectionAttributes
     bool exec;
     bool write;
     uint64_t align;
+    bool tls = false;
+    bool large = false;     // may be placed beyond 2 GiB of the code, SHF_X86_64_LARGE
+    uint64_t entsize = 0;   // piece size of a mergeable section, 0 if it isn't one
+    bool strings = false;   // the pieces are nul terminated strings instead
+};
+
+// an instruction that starts at offset behind fragment fragments came from a source line
+struct LineRow
+{
+    uint64_t offset;
+    size_t fragment;
+    uint32_t line;
+};
+
+enum CfiOp
+{
+    CFI_DEF_CFA,
+    CFI_DEF_CFA_REGISTER,
+    CFI_DEF_CFA_OFFSET,
+    CFI_OFFSET,
+    CFI_RESTORE,
+};
+
+// registers use the dwarf numbering, locations are offset and fragment count like line rows
+struct CfiInstruction
+{
+    uint64_t offset;
+    size_t fragment;
+    CfiOp op;
+    int reg;
+    int64_t value;
+};
+
+// the unwind info of one function, an fde in .eh_frame
+struct Frame
+{
+    uint64_t start;
+    size_t start_fragment;
+    uint64_t end = 0;
+    size_t end_fragment = 0;
+    std::vector<CfiInstruction> insns;
+};
+
+// where the cfa is while a frame is open, body is the state after the prologue for auto frames
+struct FrameState
+{
+    Section* section = nullptr;     // of the open frame, null if there is none
+    bool is_auto = false;
+    bool in_prologue = false;
+    int cfa_register = 7;
+    int64_t cfa_offset = 8;
+    int64_t stack_offset = 8;       // cfa - rsp
+    int body_register = 7;
+    int64_t body_offset = 8;
+    int64_t body_stack = 8;
+    bool restore_pending = false;   // a ret left the cfa to go back to the body state at the next instruction
+    Symbol* label = nullptr;        // last label in code, an auto frame starts there if a prologue follows
 };
 
 struct Section
 {
     std::string name;
     SectionAttributes attr;
-    std::vector<uint8_t> bytes;
+    ChunkedBytes bytes;
+    uint64_t reserved = 0;  // size of a nobits section, which never has bytes
     std::vector<Relocation> rels;
+    std::vector<Fragment> fragments;
+    std::vector<LineRow> lines;
+    std::vector<Frame> frames;
+    std::vector<Symbol*> labels;    // defined in this section, so layout doesn't have to look at every symbol
+    std::string group;      // signature of the comdat group it is in, empty if none
+    uint32_t index = 0;     // section header index, set by the writer
+    uint32_t symbol = 0;    // index of its section symbol, set by the writer
+
+    uint64_t size() const { return attr.progbits ? bytes.size() : reserved; }
+};
+
+enum FragmentType
+{
+    FRAG_ALIGN,
+    FRAG_LOOP_ALIGN,
+    FRAG_BRANCH,
+    FRAG_BOUNDARY,
+    FRAG_PREFIX,
+    FRAG_LITERAL,
+};
+
+enum InstructionFlags
+{
+    INSN_JUMP = 1,
+    INSN_FUSIBLE = 2,       // can macro-fuse with a following jcc
+    INSN_PREFIXABLE = 4,    // a redundant segment prefix doesn't change its meaning
+};
+
+// a piece of a section whose size depends on where it ends up, sitting in front of bytes[offset]
+struct Fragment
+{
+    FragmentType type;
+    uint64_t offset;
+    uint64_t address = 0;   // set by layout
+    uint64_t size = 0;      // set by layout
+
+    // align and loop align, max_skip is also the most prefixes a prefix fragment can take
+    uint64_t alignment = 1;
+    uint64_t max_skip = 0;
+    uint8_t fill = 0;
+    size_t loop_end = SIZE_MAX;
+    bool is_active = false;
+
+    // branch
+    int cond = -1;          // -1 for jmp
+    Symbol* target = nullptr;
+    int64_t addend = 0;
+    bool is_long = false;
+
+    // padding the fragment asked for, part of it may end up as prefixes on earlier instructions
+    uint64_t padding = 0;
+
+    // boundary and prefix
+    uint64_t length = 0;    // of the instruction in front of which a boundary or prefix fragment sits, of the data of a literal
+    bool is_fusible = false;
+
+    // literal, a padding fragment with the item's alignment followed by one with its data, both empty when dropped
+    size_t literal = SIZE_MAX;  // index into Output::literals for the data fragment
+};
+
+// size of sym given as end - start + offset, known after layout, the symbols are null for plain numbers
+struct SymbolSize
+{
+    Symbol* sym;
+    Symbol* end;
+    Symbol* start;
+    int64_t offset;
+};
+
+// labels and the read-only data behind them, once the next label shows up the item becomes a
+// literal that layout may move to a mergeable section or replace by an identical one
+struct DataItem
+{
+    Section* section = nullptr;     // null when there is no open item
+    uint64_t start = 0;
+    size_t rels = 0;                // relocation and fragment counts at the start, an item that adds any stays
+    size_t fragments = 0;
+    std::vector<Symbol*> labels;
+
+    // an align right in front of the item is its alignment, its padding goes away with the item
+    Section* aligned = nullptr;
+    uint64_t align = 1;
+    uint64_t padding = 0;
+    uint8_t fill = 0;
+    bool is_fragment = false;       // the align was a fragment, the last one of the section
+};
+
+// an item that ended up as a padding and a data fragment
+struct Literal
+{
+    Section* section;
+    size_t fragment;                // the padding fragment, the data fragment follows
+    std::vector<uint8_t> bytes;
+    std::vector<Symbol*> labels;
 };
 
 struct Relocation
@@ -44,16 +210,48 @@ struct Relocation
     uint64_t offset;
     int64_t addend;
     int type;
+    Symbol* minus = nullptr;    // sym - minus + addend, resolved or turned pc relative after layout
 };
 
+void append_nops(ChunkedBytes& bytes, uint64_t count, int max_nop_size);
+
 struct Output
 {
+    Arena<Symbol> symbol_arena;
+    Arena<Section, 64> section_arena;
+    NameTable<Symbol> symbol_table;
+    NameTable<Section> section_table;
+
     std::vector<Symbol*> symbols;
     std::vector<Section*> sections;
     Section* current_section;
+    Section* text_section;          // the one picked by the last section directive, function sections are named after it
+
+    const TuningProfile* tune;
+    uint64_t loop_align = 0;
+    uint64_t function_align = 0;    // -falign-functions, for exported and function labels in code
+    uint64_t branch_boundary = 0;
+    bool pad_with_prefixes = false;
+    bool large_model = false;       // -mcmodel=large, symbols are 64 bit
+    uint64_t large_data_threshold = 65536;  // data sections larger than this go to the large sections in the large model
+    bool auto_sizes = false;        // exported labels without a size run to the next one
+    bool debug_lines = false;       // -g, instructions remember their source line
+    bool auto_cfi = false;          // frames and cfi from labels and standard prologues
+    bool function_sections = false; // exported and function labels in code start a section of their own
+    bool merge_constants = false;   // labeled strings and constants in .rodata go to the mergeable sections
+    bool dedup_literals = false;    // identical read-only items share one copy
+    DataItem item;
+    std::vector<Literal> literals;
+    FrameState frame;
+    std::vector<SymbolSize> sizes;
+    size_t instruction_fragment = 0;
+    int tls_sequence = 0;           // R_X86_64_TLSGD or TLSLD when the last instruction started a tls call sequence
+
+    Output(const TuningProfile* _tune = &tuning_profiles[0]);
 
     Symbol* get_symbol(const std::string& name);
     Symbol* add_symbol(const std::string& name);
+    Symbol* reference_symbol(const std::string& name);
     void define_symbol(const std::string& name);
     void export_symbol(const std::string& name);
     void import_symbol(const std::string& name);
@@ -61,8 +259,39 @@ struct Output
     Section* get_section(const std::string& name);
     Section* add_section(const std::string& name, const SectionAttributes& attr = { true, true, false, false, 1 });
     void set_current_section(const std::string& name);
+    void set_group(const std::string& signature);
+    void end_item();
+    void resolve_literals();
+    void place_large_data();
+    ChunkedBytes& data();
 
     void add(uint8_t byte);
     void add(const std::vector<uint8_t>& bytes);
     void add_imm(uint64_t value, int size);
+    void add_nops(uint64_t count);
+    void reserve(uint64_t count);
+    void repeat(uint64_t count, const std::function<void()>& emit);
+
+    void align(uint64_t alignment, uint64_t max_skip = UINT64_MAX, uint8_t fill = 0);
+    void add_branch(int cond, const std::string& target, int64_t addend);
+    void add_relocation(const std::string& name, int type, int64_t addend);
+    void add_difference(const std::string& name, const std::string& minus, int type, int64_t addend);
+
+    void add_line(uint32_t line);
+
+    void start_frame(bool is_auto, uint64_t offset, size_t fragment);
+    void end_frame();
+    void add_cfi(CfiOp op, int reg, int64_t value);
+
+    void begin_instruction(int flags);
+    void end_instruction();
+
+    Fragment& add_fragment(FragmentType type);
+
+    void layout();
+    void layout(Section* sec);
+    void resolve_relocations(Section* sec);
+    void set_size(const std::string& name, const std::string& end, const std::string& start, int64_t offset);
+    void resolve_sizes();
+    void dump();
 };
\ No newline at end of file
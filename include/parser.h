@@ -3,10 +3,12 @@
 #include "tokenizer.h"
 #include "expr.h"
 #include "instruction.h"
+#include "directive.h"
 
 bool parse_label(TokenStream& ts, std::string& label);
 
-// bool parse_directive(TokenStream& ts, Directive& dir);
+bool parse_times(TokenStream& ts, uint64_t& count);
+bool parse_directive(TokenStream& ts, Directive& dir);
 
 bool parse_instruction(TokenStream& ts, Instruction& inst);
 bool parse_operand(TokenStream& ts, Operand& op);
@@ -15,4 +17,6 @@ bool parse_register(TokenStream& ts, Operand& op);
 bool parse_memory(TokenStream& ts, Operand& op);
 bool parse_immediate(TokenStream& ts, Operand& op);
 
-bool parse_constant_sum(TokenStream& ts, Constant& c);
\ No newline at end of file
+bool parse_constant_unary(TokenStream& ts, Constant& c);
+bool parse_constant_sum(TokenStream& ts, Constant& c);
+bool parse_constant_shift(TokenStream& ts, Constant& c);
\ No newline at end of file
@@ -16,6 +16,9 @@ enum TokenType
     PLUS,
     MINUS,
     TIMES,
+    SHIFT_LEFT,
+    SHIFT_RIGHT,
+    STRING,
 };
 
 struct Token
@@ -40,4 +43,8 @@ struct TokenStream
 
     const Token& operator[](size_t i) const;
     explicit operator bool() const;
+
+private:
+    void split(const std::string& text);
+    size_t add_string(const std::string& text, size_t quote);
 };
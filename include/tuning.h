@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct TuningProfile
+{
+    std::string name;
+
+    int max_nop_size;       // longest single nop decoded without a penalty
+    int max_prefixes;       // redundant prefixes an instruction may take before decoding slows down
+    int function_align;
+    int loop_align;
+    int loop_max_skip;      // most padding worth spending on a loop head
+
+    bool jcc_erratum;       // branches crossing or ending on a 32 byte boundary miss the uop cache
+};
+
+extern std::vector<TuningProfile> tuning_profiles;
+
+const TuningProfile* get_tuning_profile(const std::string& name);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <deque>
+#include <elf.h>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "output.h"
+
+// collects unique strings and lays them out once all are known, a string that is
+// the tail of another one points into it instead of getting its own bytes
+struct StringTable
+{
+    std::vector<char> bytes = std::vector<char>(1, 0);
+    std::deque<std::string> strings;
+    std::unordered_map<std::string_view, uint32_t> ids;
+    std::vector<uint32_t> offsets;
+
+    uint32_t add(const std::string& str);   // returns an id, turned into an offset after finalize
+    void finalize();
+    uint32_t offset(uint32_t id) const;
+};
+
+// a piece of the output file, views are laid out back to back
+struct FileView
+{
+    const void* data;
+    size_t size;
+};
+
+// an SHT_GROUP section, the comdat flag followed by the indices of its members
+struct SectionGroup
+{
+    std::string signature;
+    size_t index;
+    std::vector<uint32_t> words;
+};
+
+struct ElfWriter
+{
+    Output& out;
+    std::string source_name;
+    unsigned threads;
+
+    std::vector<Section*> sections;     // the written ones, in section header order
+    std::vector<SectionGroup> groups;
+    std::unordered_map<std::string, size_t> group_ids;
+    std::vector<Elf64_Shdr> shdrs;
+    std::vector<Elf64_Sym> syms;
+    std::vector<uint32_t> shndx;        // full section indices of the symbols, written when there are too many sections
+    std::vector<std::vector<Elf64_Rela>> relas;
+    StringTable strtab;
+    StringTable shstrtab;
+    Elf64_Ehdr ehdr;
+    uint64_t file_size = 0;
+
+    size_t symtab_index;
+    size_t strtab_index;
+    size_t shstrtab_index;
+    size_t symtab_shndx_index = 0;
+
+    ElfWriter(Output& _out, const std::string& _source_name, unsigned _threads = 1);
+
+    void build();
+    std::vector<FileView> views() const;
+    void write(const std::string& path) const;
+    // both fill a presized file on the writer threads, through mmap or pwrite
+    void write_mapped(const std::string& path) const;
+    void write_positioned(const std::string& path) const;
+
+private:
+    void build_sections();
+    void build_symbols();
+    void build_relocations();
+    void build_layout();
+
+    int create(const std::string& path) const;
+    bool copy_views(const std::function<bool(uint64_t, const FileView&)>& copy) const;
+
+    void add_symbol(Elf64_Sym sym, uint32_t section);
+    size_t add_shdr(const std::string& name, uint32_t type, uint64_t flags, uint64_t align, uint64_t entsize = 0);
+};
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cstring>
+
+#include "chunked_bytes.h"
+
+using namespace std;
+
+const size_t growing_chunks = ChunkedBytes::max_shift - ChunkedBytes::min_shift;
+const size_t growing_size = (1ul << ChunkedBytes::max_shift) - (1ul << ChunkedBytes::min_shift);
+
+size_t ChunkedBytes::chunk_capacity(size_t index)
+{
+    return 1ul << (min_shift + min(index, growing_chunks));
+}
+
+size_t ChunkedBytes::chunk_start(size_t index)
+{
+    if (index < growing_chunks)
+        return (1ul << (min_shift + index)) - (1ul << min_shift);
+
+    return growing_size + ((index - growing_chunks) << max_shift);
+}
+
+void ChunkedBytes::locate(size_t offset, size_t& index, size_t& within)
+{
+    if (offset < growing_size)
+    {
+        size_t biased = offset + (1ul << min_shift);
+
+        index = 63 - __builtin_clzl(biased) - min_shift;
+        within = biased - (1ul << (min_shift + index));
+    }
+    else
+    {
+        index = growing_chunks + ((offset - growing_size) >> max_shift);
+        within = (offset - growing_size) & ((1ul << max_shift) - 1);
+    }
+}
+
+// room at the end of the last chunk, adding a chunk if it is full, count is clamped to what fits
+uint8_t* ChunkedBytes::reserve(size_t& count)
+{
+    size_t index;
+    size_t within;
+
+    locate(length, index, within);
+
+    if (index == chunks.size())
+        chunks.emplace_back(new uint8_t[chunk_capacity(index)]);
+
+    count = min(count, chunk_capacity(index) - within);
+
+    return chunks[index].get() + within;
+}
+
+void ChunkedBytes::push_back(uint8_t byte)
+{
+    size_t count = 1;
+
+    *reserve(count) = byte;
+    length++;
+}
+
+void ChunkedBytes::append(const uint8_t* data, size_t count)
+{
+    while (count)
+    {
+        size_t n = count;
+        uint8_t* dest = reserve(n);
+
+        memcpy(dest, data, n);
+
+        data += n;
+        count -= n;
+        length += n;
+    }
+}
+
+void ChunkedBytes::append(size_t count, uint8_t byte)
+{
+    while (count)
+    {
+        size_t n = count;
+        uint8_t* dest = reserve(n);
+
+        memset(dest, byte, n);
+
+        count -= n;
+        length += n;
+    }
+}
+
+void ChunkedBytes::append(const ChunkedBytes& other, size_t from, size_t to)
+{
+    while (from < to)
+    {
+        size_t index;
+        size_t within;
+
+        other.locate(from, index, within);
+
+        size_t n = min(to - from, chunk_capacity(index) - within);
+
+        append(other.chunks[index].get() + within, n);
+        from += n;
+    }
+}
+
+// appends copies of [from, size()), copying everything repeated so far each round
+void ChunkedBytes::repeat(size_t from, size_t copies)
+{
+    size_t piece = size() - from;
+    size_t done = 1;
+
+    while (copies && piece)
+    {
+        size_t n = min(done, copies);
+
+        append(*this, from, from + n * piece);
+
+        done += n;
+        copies -= n;
+    }
+}
+
+void ChunkedBytes::write(size_t offset, const uint8_t* data, size_t count)
+{
+    while (count)
+    {
+        size_t index;
+        size_t within;
+
+        locate(offset, index, within);
+
+        size_t n = min(count, chunk_capacity(index) - within);
+
+        memcpy(chunks[index].get() + within, data, n);
+
+        offset += n;
+        data += n;
+        count -= n;
+    }
+}
+
+void ChunkedBytes::read(size_t offset, uint8_t* data, size_t count) const
+{
+    while (count)
+    {
+        size_t index;
+        size_t within;
+
+        locate(offset, index, within);
+
+        size_t n = min(count, chunk_capacity(index) - within);
+
+        memcpy(data, chunks[index].get() + within, n);
+
+        offset += n;
+        data += n;
+        count -= n;
+    }
+}
+
+uint8_t ChunkedBytes::operator[](size_t offset) const
+{
+    size_t index;
+    size_t within;
+
+    locate(offset, index, within);
+
+    return chunks[index][within];
+}
+
+size_t ChunkedBytes::chunk_count() const
+{
+    return chunks.size();
+}
+
+const uint8_t* ChunkedBytes::chunk_data(size_t index) const
+{
+    return chunks[index].get();
+}
+
+// bytes in use in a chunk, only the last one can be partially filled
+size_t ChunkedBytes::chunk_size(size_t index) const
+{
+    return min(chunk_capacity(index), length - chunk_start(index));
+}
+
+void ChunkedBytes::swap(ChunkedBytes& other)
+{
+    chunks.swap(other.chunks);
+    std::swap(length, other.length);
+}
+
+void ChunkedBytes::clear()
+{
+    chunks.clear();
+    length = 0;
+}
+
+// frees the chunks that lie entirely before offset, for consumers that only walk forward
+void ChunkedBytes::release(size_t offset)
+{
+    size_t index;
+    size_t within;
+
+    locate(offset, index, within);
+
+    // walking back stops at the first chunk that is already gone
+    for (size_t i = min(index, chunks.size()); i-- > 0 && chunks[i];)
+        chunks[i].reset();
+}
+
+// drops everything from offset on, the chunk it falls in is kept for the next appends
+void ChunkedBytes::truncate(size_t offset)
+{
+    size_t index;
+    size_t within;
+
+    locate(offset, index, within);
+
+    chunks.resize(min(chunks.size(), within ? index + 1 : index));
+    length = offset;
+}
@@ -0,0 +1,336 @@
+#include <unordered_map>
+#include <unordered_set>
+#include <elf.h>
+
+#include "directive.h"
+#include "output.h"
+
+using namespace std;
+
+unordered_set<string> directives =
+{
+    "align",
+    "section", "comdat",
+    "global", "export",
+    "extern", "import",
+    "type", "size",
+    "resb", "resw", "resd", "resq",
+    "db", "dw", "dd", "dq",
+    ".cfi_startproc", ".cfi_endproc",
+    ".cfi_def_cfa", ".cfi_def_cfa_register", ".cfi_def_cfa_offset", ".cfi_adjust_cfa_offset",
+    ".cfi_offset", ".cfi_restore",
+};
+
+// dwarf numbers of the registers that unwind info can name
+unordered_map<string, int> dwarf_registers =
+{
+    {"rax", 0}, {"rdx", 1}, {"rcx", 2}, {"rbx", 3}, {"rsi", 4}, {"rdi", 5}, {"rbp", 6}, {"rsp", 7},
+    {"r8",  8}, {"r9",  9}, {"r10", 10}, {"r11", 11}, {"r12", 12}, {"r13", 13}, {"r14", 14}, {"r15", 15},
+    {"rip", 16},
+};
+
+bool is_directive(const string& name)
+{
+    return directives.count(name);
+}
+
+uint64_t get_number(const Directive& dir, size_t i)
+{
+    if (dir.args[i].is_symbolic())
+        throw runtime_error("expected a number as argument " + to_string(i + 1) + " of " + dir.name);
+
+    return dir.args[i].offset;
+}
+
+string get_name(const Directive& dir, size_t i)
+{
+    if (dir.args[i].symbol.empty() || dir.args[i].is_difference() || dir.args[i].offset)
+        throw runtime_error("expected a name as argument " + to_string(i + 1) + " of " + dir.name);
+
+    return dir.args[i].symbol;
+}
+
+void expect_args(const Directive& dir, size_t min, size_t max)
+{
+    if (dir.args.size() < min)
+        throw runtime_error("not enough arguments for " + dir.name);
+
+    if (dir.args.size() > max)
+        throw runtime_error("too many arguments for " + dir.name);
+}
+
+int get_register(const Directive& dir, size_t i)
+{
+    auto it = dwarf_registers.find(get_name(dir, i));
+
+    if (it == dwarf_registers.end())
+        throw runtime_error("expected a 64 bit register as argument " + to_string(i + 1) + " of " + dir.name);
+
+    return it->second;
+}
+
+// b, w, d, q suffix of data and reserve directives
+uint64_t data_size(char suffix)
+{
+    switch (suffix)
+    {
+    case 'b': return 1;
+    case 'w': return 2;
+    case 'd': return 4;
+    default: return 8;
+    }
+}
+
+int data_relocation(int size)
+{
+    switch (size)
+    {
+    case 1: return R_X86_64_8;
+    case 2: return R_X86_64_16;
+    case 4: return R_X86_64_32;
+    default: return R_X86_64_64;
+    }
+}
+
+int data_pc_relocation(int size)
+{
+    switch (size)
+    {
+    case 1: return R_X86_64_PC8;
+    case 2: return R_X86_64_PC16;
+    case 4: return R_X86_64_PC32;
+    default: return R_X86_64_PC64;
+    }
+}
+
+// -1 if the word isn't a symbol type
+int symbol_type(const string& word)
+{
+    if (word == "function")
+        return STT_FUNC;
+
+    if (word == "object")
+        return STT_OBJECT;
+
+    if (word == "notype")
+        return STT_NOTYPE;
+
+    return -1;
+}
+
+// visibility and type words after global sym: and extern sym:
+void get_qualifiers(const Directive& dir, size_t i, int& visibility, int& type)
+{
+    visibility = STV_DEFAULT;
+    type = -1;
+
+    for (auto& word : dir.qualifiers[i])
+    {
+        if (word == "default")
+            visibility = STV_DEFAULT;
+        else if (word == "hidden")
+            visibility = STV_HIDDEN;
+        else if (word == "protected")
+            visibility = STV_PROTECTED;
+        else if (word == "internal")
+            visibility = STV_INTERNAL;
+        else if (symbol_type(word) >= 0)
+            type = symbol_type(word);
+        else
+            throw runtime_error("unknown qualifier '" + word + "' for " + dir.name);
+    }
+}
+
+void apply_qualifiers(Symbol* sym, int visibility, int type)
+{
+    sym->visibility = visibility;
+
+    if (type >= 0)
+        sym->type = type;
+}
+
+void apply_directive(Output& out, const Directive& dir)
+{
+    bool qualified = false;
+
+    for (auto& words : dir.qualifiers)
+        qualified |= !words.empty();
+
+    if (qualified && dir.name != "global" && dir.name != "export" && dir.name != "extern" && dir.name != "import")
+        throw runtime_error(dir.name + " doesn't take qualifiers");
+
+    if (dir.name == "align")
+    {
+        expect_args(dir, 1, 3);
+
+        uint64_t alignment = get_number(dir, 0);
+        uint64_t max_skip = (dir.args.size() > 1) ? get_number(dir, 1) : UINT64_MAX;
+        uint64_t fill = (dir.args.size() > 2) ? get_number(dir, 2) : 0;
+
+        if (fill > 0xff)
+            throw runtime_error("align fill value must fit in a byte");
+
+        out.align(alignment, max_skip, fill);
+    }
+    else if (dir.name == "section")
+    {
+        expect_args(dir, 1, 1);
+
+        out.set_current_section(get_name(dir, 0));
+    }
+    else if (dir.name == "comdat")
+    {
+        expect_args(dir, 1, 1);
+
+        out.set_group(get_name(dir, 0));
+    }
+    else if (dir.name == "global" || dir.name == "export")
+    {
+        expect_args(dir, 1, SIZE_MAX);
+
+        for (size_t i = 0; i < dir.args.size(); i++)
+        {
+            int visibility, type;
+            get_qualifiers(dir, i, visibility, type);
+
+            out.export_symbol(get_name(dir, i));
+            apply_qualifiers(out.get_symbol(get_name(dir, i)), visibility, type);
+        }
+    }
+    else if (dir.name == "extern" || dir.name == "import")
+    {
+        expect_args(dir, 1, SIZE_MAX);
+
+        for (size_t i = 0; i < dir.args.size(); i++)
+        {
+            int visibility, type;
+            get_qualifiers(dir, i, visibility, type);
+
+            out.import_symbol(get_name(dir, i));
+            apply_qualifiers(out.get_symbol(get_name(dir, i)), visibility, type);
+        }
+    }
+    else if (dir.name == "type")
+    {
+        expect_args(dir, 2, 2);
+
+        int type = symbol_type(get_name(dir, 1));
+
+        if (type < 0)
+            throw runtime_error("symbol type must be function, object or notype");
+
+        out.reference_symbol(get_name(dir, 0))->type = type;
+    }
+    else if (dir.name == "size")
+    {
+        expect_args(dir, 2, 2);
+
+        const Constant& size = dir.args[1];
+
+        if (!size.symbol.empty() != size.is_difference())
+            throw runtime_error("size must be a number or a difference of labels");
+
+        out.set_size(get_name(dir, 0), size.symbol, size.minus, size.offset);
+    }
+    else if (dir.name == ".cfi_startproc")
+    {
+        expect_args(dir, 0, 0);
+
+        out.start_frame(false, out.current_section->size(), out.current_section->fragments.size());
+    }
+    else if (dir.name == ".cfi_endproc")
+    {
+        expect_args(dir, 0, 0);
+
+        if (out.frame.section && out.frame.is_auto)
+            throw runtime_error(".cfi_endproc without .cfi_startproc");
+
+        out.end_frame();
+    }
+    else if (dir.name == ".cfi_def_cfa")
+    {
+        expect_args(dir, 2, 2);
+
+        out.add_cfi(CFI_DEF_CFA, get_register(dir, 0), get_number(dir, 1));
+    }
+    else if (dir.name == ".cfi_def_cfa_register")
+    {
+        expect_args(dir, 1, 1);
+
+        out.add_cfi(CFI_DEF_CFA_REGISTER, get_register(dir, 0), 0);
+    }
+    else if (dir.name == ".cfi_def_cfa_offset")
+    {
+        expect_args(dir, 1, 1);
+
+        out.add_cfi(CFI_DEF_CFA_OFFSET, 0, get_number(dir, 0));
+    }
+    else if (dir.name == ".cfi_adjust_cfa_offset")
+    {
+        expect_args(dir, 1, 1);
+
+        out.add_cfi(CFI_DEF_CFA_OFFSET, 0, out.frame.cfa_offset + (int64_t)get_number(dir, 0));
+    }
+    else if (dir.name == ".cfi_offset")
+    {
+        expect_args(dir, 2, 2);
+
+        int64_t offset = get_number(dir, 1);
+
+        if (offset % 8)
+            throw runtime_error("register save offset must be a multiple of 8");
+
+        out.add_cfi(CFI_OFFSET, get_register(dir, 0), offset);
+    }
+    else if (dir.name == ".cfi_restore")
+    {
+        expect_args(dir, 1, 1);
+
+        out.add_cfi(CFI_RESTORE, get_register(dir, 0), 0);
+    }
+    else if (dir.name[0] == 'd')
+    {
+        expect_args(dir, 1, SIZE_MAX);
+
+        int size = data_size(dir.name.back());
+
+        for (auto& arg : dir.args)
+        {
+            if (arg.is_difference())
+            {
+                if (arg.symbol.empty())
+                    throw runtime_error("cannot subtract a symbol from a number");
+
+                out.add_difference(arg.symbol, arg.minus, data_pc_relocation(size), arg.offset);
+                out.add_imm(0, size);
+
+                continue;
+            }
+
+            if (arg.is_symbolic())
+            {
+                out.add_relocation(arg.symbol, data_relocation(size), arg.offset);
+                out.add_imm(0, size);
+
+                continue;
+            }
+
+            if (size < 8 && (arg.offset < -(1ll << (size * 8 - 1)) || arg.offset >= (1ll << (size * 8))))
+                throw runtime_error("value doesn't fit in " + dir.name);
+
+            out.add_imm(arg.offset, size);
+        }
+    }
+    else if (dir.name[0] == 'r')
+    {
+        expect_args(dir, 1, 1);
+
+        uint64_t size = data_size(dir.name.back());
+        uint64_t count = get_number(dir, 0);
+
+        if (count > UINT64_MAX / size)
+            throw runtime_error(dir.name + " count is too large");
+
+        out.reserve(count * size);
+    }
+}
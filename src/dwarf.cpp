@@ -0,0 +1,442 @@
+#include <elf.h>
+
+#include "dwarf.h"
+#include "output.h"
+
+using namespace std;
+
+const int line_base = -5;
+const int line_range = 14;
+const int opcode_base = 13;
+
+enum
+{
+    DW_LNS_copy = 1,
+    DW_LNS_advance_pc = 2,
+    DW_LNS_advance_line = 3,
+    DW_LNE_end_sequence = 1,
+    DW_LNE_set_address = 2,
+    DW_LNCT_path = 1,
+    DW_LNCT_directory_index = 2,
+    DW_FORM_addr = 0x01,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_sec_offset = 0x17,
+    DW_TAG_compile_unit = 0x11,
+    DW_AT_name = 0x03,
+    DW_AT_stmt_list = 0x10,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_language = 0x13,
+    DW_AT_comp_dir = 0x1b,
+    DW_AT_producer = 0x25,
+    DW_AT_ranges = 0x55,
+    DW_RLE_end_of_list = 0x00,
+    DW_RLE_start_length = 0x07,
+    DW_UT_compile = 1,
+    DW_LANG_Mips_Assembler = 0x8001,
+    DW_CFA_nop = 0x00,
+    DW_CFA_advance_loc1 = 0x02,
+    DW_CFA_advance_loc2 = 0x03,
+    DW_CFA_advance_loc4 = 0x04,
+    DW_CFA_offset_extended_sf = 0x11,
+    DW_CFA_def_cfa = 0x0c,
+    DW_CFA_def_cfa_register = 0x0d,
+    DW_CFA_def_cfa_offset = 0x0e,
+    DW_CFA_advance_loc = 0x40,
+    DW_CFA_offset = 0x80,
+    DW_CFA_restore = 0xc0,
+    DW_EH_PE_pcrel_sdata4 = 0x1b,
+};
+
+const int code_alignment = 1;
+const int data_alignment = -8;
+const int return_register = 16;
+
+void add_uleb(Output& out, uint64_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+
+        out.add(value ? byte | 0x80 : byte);
+    }
+    while (value);
+}
+
+void add_sleb(Output& out, int64_t value)
+{
+    while (true)
+    {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+
+        if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)))
+        {
+            out.add(byte);
+            return;
+        }
+
+        out.add(byte | 0x80);
+    }
+}
+
+void add_string(Output& out, const string& str)
+{
+    out.add(vector<uint8_t>(str.begin(), str.end()));
+    out.add(0);
+}
+
+// a relocation against the start of a section, what the writer turns into its section symbol
+void add_section_address(Output& out, Section* target, int64_t addend, int type, int size)
+{
+    Section* sec = out.current_section;
+
+    sec->rels.push_back({ nullptr, target, sec->size(), addend, type });
+    out.add_imm(0, size);
+}
+
+// lengths are only known at the end, so a 4 byte hole is left and filled in later
+uint64_t begin_length(Output& out)
+{
+    uint64_t offset = out.current_section->size();
+    out.add_imm(0, 4);
+
+    return offset;
+}
+
+void end_length(Output& out, uint64_t offset)
+{
+    uint32_t length = out.current_section->size() - offset - 4;
+    uint8_t bytes[4] = { (uint8_t)length, (uint8_t)(length >> 8), (uint8_t)(length >> 16), (uint8_t)(length >> 24) };
+
+    out.current_section->bytes.write(offset, bytes, 4);
+}
+
+// one sequence per section, rows use special opcodes when line and address advance by little
+void add_sequence(Output& out, Section* target)
+{
+    out.add(0);
+    add_uleb(out, 9);
+    out.add(DW_LNE_set_address);
+    add_section_address(out, target, 0, R_X86_64_64, 8);
+
+    uint64_t address = 0;
+    int64_t line = 1;
+
+    for (auto& row : target->lines)
+    {
+        int64_t line_delta = (int64_t)row.line - line;
+        uint64_t address_delta = row.offset - address;
+
+        if (line_delta < line_base || line_delta >= line_base + line_range)
+        {
+            out.add(DW_LNS_advance_line);
+            add_sleb(out, line_delta);
+            line_delta = 0;
+        }
+
+        uint64_t opcode = (line_delta - line_base) + line_range * address_delta + opcode_base;
+
+        if (opcode > 255)
+        {
+            out.add(DW_LNS_advance_pc);
+            add_uleb(out, address_delta);
+            opcode = (line_delta - line_base) + opcode_base;
+        }
+
+        out.add(opcode);
+
+        address = row.offset;
+        line = row.line;
+    }
+
+    out.add(DW_LNS_advance_pc);
+    add_uleb(out, target->size() - address);
+
+    out.add(0);
+    add_uleb(out, 1);
+    out.add(DW_LNE_end_sequence);
+}
+
+void add_debug_lines(Output& out, const string& source_name, const string& comp_dir)
+{
+    vector<Section*> targets;
+
+    for (auto& sec : out.sections)
+        if (!sec->lines.empty())
+            targets.push_back(sec);
+
+    if (targets.empty())
+        return;
+
+    for (auto name : { ".debug_line", ".debug_abbrev", ".debug_info", ".debug_rnglists" })
+        if (out.get_section(name))
+            throw runtime_error(string("section ") + name + " can't be used together with -g");
+
+    Section* previous = out.current_section;
+    SectionAttributes debug = { true, false, false, false, 1 };
+
+    Section* line_section = out.add_section(".debug_line", debug);
+    out.current_section = line_section;
+
+    uint64_t unit_length = begin_length(out);
+
+    out.add_imm(5, 2);
+    out.add(8);
+    out.add(0);
+
+    uint64_t header_length = begin_length(out);
+
+    out.add(1);
+    out.add(1);
+    out.add(1);
+    out.add((uint8_t)line_base);
+    out.add(line_range);
+    out.add(opcode_base);
+    out.add({ 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 });
+
+    out.add(1);
+    add_uleb(out, DW_LNCT_path);
+    add_uleb(out, DW_FORM_string);
+    add_uleb(out, 1);
+    add_string(out, comp_dir);
+
+    // entry 0 is the primary source file and entry 1 is the same file for the default file register
+    out.add(2);
+    add_uleb(out, DW_LNCT_path);
+    add_uleb(out, DW_FORM_string);
+    add_uleb(out, DW_LNCT_directory_index);
+    add_uleb(out, DW_FORM_udata);
+    add_uleb(out, 2);
+
+    for (int i = 0; i < 2; i++)
+    {
+        add_string(out, source_name);
+        add_uleb(out, 0);
+    }
+
+    end_length(out, header_length);
+
+    for (auto& sec : targets)
+        add_sequence(out, sec);
+
+    end_length(out, unit_length);
+
+    // one section is covered by low and high pc, more need a range list
+    Section* ranges = nullptr;
+
+    if (targets.size() > 1)
+    {
+        ranges = out.add_section(".debug_rnglists", debug);
+        out.current_section = ranges;
+
+        uint64_t ranges_length = begin_length(out);
+
+        out.add_imm(5, 2);
+        out.add(8);
+        out.add(0);
+        out.add_imm(0, 4);
+
+        for (auto& sec : targets)
+        {
+            out.add(DW_RLE_start_length);
+            add_section_address(out, sec, 0, R_X86_64_64, 8);
+            add_uleb(out, sec->size());
+        }
+
+        out.add(DW_RLE_end_of_list);
+
+        end_length(out, ranges_length);
+    }
+
+    // tools only look at line tables of compile units, this one covers every section with lines
+    Section* abbrev = out.add_section(".debug_abbrev", debug);
+    out.current_section = abbrev;
+
+    add_uleb(out, 1);
+    add_uleb(out, DW_TAG_compile_unit);
+    out.add(0);
+
+    add_uleb(out, DW_AT_stmt_list);
+    add_uleb(out, DW_FORM_sec_offset);
+    add_uleb(out, DW_AT_low_pc);
+    add_uleb(out, DW_FORM_addr);
+    add_uleb(out, ranges ? DW_AT_ranges : DW_AT_high_pc);
+    add_uleb(out, ranges ? DW_FORM_sec_offset : DW_FORM_data8);
+
+    for (int attr : { DW_AT_name, DW_FORM_string, DW_AT_comp_dir, DW_FORM_string, DW_AT_producer, DW_FORM_string,
+                      DW_AT_language, DW_FORM_data2 })
+        add_uleb(out, attr);
+
+    // end of the attributes and of the table
+    out.add({ 0, 0, 0 });
+
+    out.current_section = out.add_section(".debug_info", debug);
+
+    uint64_t info_length = begin_length(out);
+
+    out.add_imm(5, 2);
+    out.add(DW_UT_compile);
+    out.add(8);
+    add_section_address(out, abbrev, 0, R_X86_64_32, 4);
+
+    add_uleb(out, 1);
+    add_section_address(out, line_section, 0, R_X86_64_32, 4);
+
+    // with a range list low pc is the base address its entries would be relative to, they are absolute here
+    if (ranges)
+    {
+        out.add_imm(0, 8);
+        add_section_address(out, ranges, 12, R_X86_64_32, 4);
+    }
+    else
+    {
+        add_section_address(out, targets[0], 0, R_X86_64_64, 8);
+        out.add_imm(targets[0]->size(), 8);
+    }
+
+    add_string(out, source_name);
+    add_string(out, comp_dir);
+    add_string(out, "rax");
+    out.add_imm(DW_LANG_Mips_Assembler, 2);
+
+    end_length(out, info_length);
+
+    out.current_section = previous;
+}
+
+// entries are padded with nops so the next one starts aligned
+void pad_entry(Output& out)
+{
+    while (out.current_section->size() % 8)
+        out.add(DW_CFA_nop);
+}
+
+void add_advance(Output& out, uint64_t delta)
+{
+    if (delta == 0)
+        return;
+
+    if (delta < 0x40)
+        out.add(DW_CFA_advance_loc | delta);
+    else if (delta <= UINT8_MAX)
+    {
+        out.add(DW_CFA_advance_loc1);
+        out.add(delta);
+    }
+    else if (delta <= UINT16_MAX)
+    {
+        out.add(DW_CFA_advance_loc2);
+        out.add_imm(delta, 2);
+    }
+    else
+    {
+        out.add(DW_CFA_advance_loc4);
+        out.add_imm(delta, 4);
+    }
+}
+
+void add_cfi_instruction(Output& out, const CfiInstruction& insn)
+{
+    switch (insn.op)
+    {
+    case CFI_DEF_CFA:
+    case CFI_DEF_CFA_OFFSET:
+        if (insn.value < 0)
+            throw runtime_error("cfa offset can't be negative");
+
+        if (insn.op == CFI_DEF_CFA)
+        {
+            out.add(DW_CFA_def_cfa);
+            add_uleb(out, insn.reg);
+        }
+        else
+            out.add(DW_CFA_def_cfa_offset);
+
+        add_uleb(out, insn.value);
+        break;
+    case CFI_DEF_CFA_REGISTER:
+        out.add(DW_CFA_def_cfa_register);
+        add_uleb(out, insn.reg);
+        break;
+    case CFI_OFFSET:
+        // saves are below the cfa, so the factored offset is usually positive and fits the short form
+        if (insn.value / data_alignment >= 0)
+        {
+            out.add(DW_CFA_offset | insn.reg);
+            add_uleb(out, insn.value / data_alignment);
+        }
+        else
+        {
+            out.add(DW_CFA_offset_extended_sf);
+            add_uleb(out, insn.reg);
+            add_sleb(out, insn.value / data_alignment);
+        }
+        break;
+    case CFI_RESTORE:
+        out.add(DW_CFA_restore | insn.reg);
+        break;
+    }
+}
+
+void add_eh_frame(Output& out)
+{
+    if (out.get_section(".eh_frame"))
+        throw runtime_error("section .eh_frame can't be used together with cfi");
+
+    Section* previous = out.current_section;
+    out.current_section = out.add_section(".eh_frame", { true, true, false, false, 8 });
+
+    // one cie shared by all frames, at entry the cfa is rsp + 8 and the return address is just below it
+    uint64_t cie_length = begin_length(out);
+
+    out.add_imm(0, 4);
+    out.add(1);
+    add_string(out, "zR");
+    add_uleb(out, code_alignment);
+    add_sleb(out, data_alignment);
+    out.add(return_register);
+    add_uleb(out, 1);
+    out.add(DW_EH_PE_pcrel_sdata4);
+
+    out.add(DW_CFA_def_cfa);
+    add_uleb(out, 7);
+    add_uleb(out, 8);
+    out.add(DW_CFA_offset | return_register);
+    add_uleb(out, 1);
+
+    pad_entry(out);
+    end_length(out, cie_length);
+
+    for (auto& sec : out.sections)
+    {
+        for (auto& frame : sec->frames)
+        {
+            uint64_t fde_length = begin_length(out);
+
+            out.add_imm(out.current_section->size(), 4);
+            add_section_address(out, sec, frame.start, R_X86_64_PC32, 4);
+            out.add_imm(frame.end - frame.start, 4);
+            add_uleb(out, 0);
+
+            uint64_t location = frame.start;
+
+            for (auto& insn : frame.insns)
+            {
+                add_advance(out, insn.offset - location);
+                add_cfi_instruction(out, insn);
+
+                location = insn.offset;
+            }
+
+            pad_entry(out);
+            end_length(out, fde_length);
+        }
+    }
+
+    out.current_section = previous;
+}
@@ -0,0 +1,920 @@
+#include <unordered_map>
+#include <vector>
+#include <elf.h>
+
+#include "encoder.h"
+#include "output.h"
+
+using namespace std;
+
+unordered_map<string, int> conditions =
+{
+    {"o", 0},
+    {"no", 1},
+    {"c", 2}, {"b", 2}, {"nae", 2},
+    {"nc", 3}, {"nb", 3}, {"ae", 3},
+    {"e", 4}, {"z", 4},
+    {"ne", 5}, {"nz", 5},
+    {"be", 6}, {"na", 6},
+    {"nbe", 7}, {"a", 7},
+    {"s", 8},
+    {"ns", 9},
+    {"p", 10}, {"pe", 10},
+    {"np", 11}, {"po", 11},
+    {"l", 12}, {"nge", 12},
+    {"nl", 13}, {"ge", 13},
+    {"le", 14}, {"ng", 14},
+    {"nle", 15}, {"g", 15}
+};
+
+// relative jumps are left to the layout so it can pick between the rel8 and rel32 forms
+bool encode_branch(Output& out, const Instruction& inst)
+{
+    if (inst.operands.size() != 1 || inst.operands[0].type != 1 || inst.operands[0].symbol.empty())
+        return false;
+
+    int cond = -1;
+
+    if (inst.menmonic != "jmp")
+    {
+        if (inst.menmonic[0] != 'j')
+            return false;
+
+        auto it = conditions.find(inst.menmonic.substr(1));
+
+        if (it == conditions.end())
+            return false;
+
+        cond = it->second;
+    }
+
+    out.add_branch(cond, inst.operands[0].symbol, inst.operands[0].imm);
+
+    return true;
+}
+
+// plt32 lets the linker bind the call directly when the target turns out to be local
+bool encode_call(Output& out, const Instruction& inst, int tls_sequence)
+{
+    if (inst.menmonic != "call" || inst.operands.size() != 1 || inst.operands[0].type != 1 || inst.operands[0].symbol.empty())
+        return false;
+
+    if (!inst.operands[0].wrt.empty() && inst.operands[0].wrt != "..plt")
+        throw runtime_error("call can only be wrt ..plt");
+
+    // the call of a general dynamic sequence is padded with prefixes so that linkers can rewrite it in place
+    if (tls_sequence)
+    {
+        out.begin_instruction(0);
+
+        if (tls_sequence == R_X86_64_TLSGD)
+            out.add({ 0x66, 0x66, 0x48 });
+    }
+    else
+        out.begin_instruction(INSN_JUMP);
+
+    out.add(0xe8);
+    out.add_relocation(inst.operands[0].symbol, R_X86_64_PLT32, inst.operands[0].imm - 4);
+    out.add_imm(0, 4);
+    out.end_instruction();
+
+    return true;
+}
+
+bool encode_ret(Output& out, const Instruction& inst)
+{
+    if (inst.menmonic != "ret" || !inst.operands.empty())
+        return false;
+
+    out.begin_instruction(INSN_JUMP);
+    out.add(0xc3);
+    out.end_instruction();
+
+    return true;
+}
+
+// reg, [rel mem] forms, the ones a linker may rewrite when they load from the got are marked relaxable
+struct MemoryOpcode
+{
+    uint8_t opcode;
+    bool is_relaxable;
+    bool is_fusible;
+};
+
+unordered_map<string, MemoryOpcode> load_opcodes =
+{
+    {"mov", { 0x8b, true, false }},
+    {"lea", { 0x8d, false, false }},
+    {"add", { 0x03, true, true }},
+    {"or",  { 0x0b, true, false }},
+    {"adc", { 0x13, true, false }},
+    {"sbb", { 0x1b, true, false }},
+    {"and", { 0x23, true, true }},
+    {"sub", { 0x2b, true, true }},
+    {"xor", { 0x33, true, false }},
+    {"cmp", { 0x3b, true, true }},
+    {"test", { 0x85, true, true }},
+};
+
+bool is_memory(const Operand& op)
+{
+    return (op.type & 0xff) == 3;
+}
+
+bool is_tls_relocation(int type)
+{
+    switch (type)
+    {
+    case R_X86_64_GOTTPOFF:
+    case R_X86_64_TLSGD:
+    case R_X86_64_TLSLD:
+    case R_X86_64_TPOFF32:
+    case R_X86_64_DTPOFF32:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 0 if the address has no symbol
+int memory_relocation(const Operand& mem, bool relaxable, bool has_rex)
+{
+    if (mem.symbol.empty())
+    {
+        if (!mem.wrt.empty())
+            throw runtime_error("wrt needs a symbol");
+
+        return 0;
+    }
+
+    if (mem.is_relative)
+    {
+        if (mem.wrt.empty())
+            return R_X86_64_PC32;
+
+        if (mem.wrt == "..gotpcrel")
+        {
+            if (!relaxable)
+                return R_X86_64_GOTPCREL;
+
+            return has_rex ? R_X86_64_REX_GOTPCRELX : R_X86_64_GOTPCRELX;
+        }
+
+        if (mem.wrt == "..gottpoff")
+            return R_X86_64_GOTTPOFF;
+
+        if (mem.wrt == "..tlsgd")
+            return R_X86_64_TLSGD;
+
+        if (mem.wrt == "..tlsld")
+            return R_X86_64_TLSLD;
+    }
+    else
+    {
+        if (mem.wrt.empty())
+            return R_X86_64_32S;
+
+        if (mem.wrt == "..tpoff")
+            return R_X86_64_TPOFF32;
+
+        if (mem.wrt == "..dtpoff")
+            return R_X86_64_DTPOFF32;
+    }
+
+    throw runtime_error("wrt " + mem.wrt + " can't be used " + (mem.is_relative ? "in a rip relative address" : "without rel"));
+}
+
+// prefixes, rex, opcode, modrm, sib and displacement of an instruction with a reg, [mem] pair,
+// a displacement with a symbol is always 32 bit and ends the instruction, so rip relative addends are disp - 4,
+// callers that add an immediate after it move the displacement back by the immediate size
+void encode_memory(Output& out, int rex, uint8_t opcode_byte, int reg, const Operand& mem, bool relaxable)
+{
+    // a sign extended 32 bit address can't reach everything in the large model, the linker could only fail on it
+    if (out.large_model && !mem.is_relative && !mem.symbol.empty() && mem.wrt.empty())
+        throw runtime_error("'" + mem.symbol + "' may be out of range of a 32 bit address in the large model, use rel or a 64 bit address");
+
+    if (mem.segment)
+        out.add(mem.segment);
+
+    if (mem.address_override)
+        out.add(0x67);
+
+    if (reg & 8)
+        rex |= 4;
+
+    if (mem.index >= 0 && (mem.index & 8))
+        rex |= 2;
+
+    if (mem.base >= 0 && (mem.base & 8))
+        rex |= 1;
+
+    if (rex)
+        out.add(0x40 | rex);
+
+    out.add(opcode_byte);
+
+    int relocation = memory_relocation(mem, relaxable, rex);
+    int r = (reg & 7) << 3;
+    int disp_size = 4;
+
+    if (mem.is_relative)
+        out.add(r | 5);
+    else if (mem.base < 0 && mem.index < 0)
+    {
+        out.add(r | 4);
+        out.add(0x25);
+    }
+    else
+    {
+        bool sib = mem.index >= 0 || (mem.base & 7) == 4;
+        int mod = 2;
+
+        if (mem.base < 0)
+            mod = 0;
+        else if (!relocation && mem.disp >= -128 && mem.disp <= 127)
+        {
+            // rbp and r13 as base have no form without displacement
+            mod = (mem.disp || (mem.base & 7) == 5) ? 1 : 0;
+            disp_size = mod;
+        }
+
+        out.add(mod << 6 | r | (sib ? 4 : (mem.base & 7)));
+
+        if (sib)
+        {
+            int scale_bits = (mem.scale == 8) ? 3 : (mem.scale == 4) ? 2 : (mem.scale == 2) ? 1 : 0;
+            int index = (mem.index >= 0) ? (mem.index & 7) : 4;
+            int base = (mem.base >= 0) ? (mem.base & 7) : 5;
+
+            out.add(scale_bits << 6 | index << 3 | base);
+        }
+    }
+
+    if (!relocation)
+    {
+        out.add_imm(mem.disp, disp_size);
+
+        return;
+    }
+
+    if (is_tls_relocation(relocation))
+        out.reference_symbol(mem.symbol)->is_tls = true;
+
+    out.add_relocation(mem.symbol, relocation, mem.is_relative ? (int64_t)mem.disp - 4 : mem.disp);
+    out.add_imm(0, 4);
+}
+
+// tls accesses are left without padding fragments, linkers rewrite them by matching exact byte sequences
+bool is_tls_access(const Operand& mem)
+{
+    return !mem.wrt.empty() && mem.wrt != "..gotpcrel";
+}
+
+bool encode_load(Output& out, const Instruction& inst)
+{
+    auto it = load_opcodes.find(inst.menmonic);
+
+    if (it == load_opcodes.end() || inst.operands.size() != 2)
+        return false;
+
+    const Operand* reg = &inst.operands[0];
+    const Operand* mem = &inst.operands[1];
+    uint8_t opcode_byte = it->second.opcode;
+
+    // test is symmetric and a store to memory only exists for mov
+    if ((inst.menmonic == "test" || inst.menmonic == "mov") && is_memory(*reg))
+    {
+        swap(reg, mem);
+
+        if (inst.menmonic == "mov")
+            opcode_byte = 0x89;
+    }
+
+    if ((reg->type & 0xff) != 2 || !is_memory(*mem))
+        return false;
+
+    int size = reg->type >> 8;
+    int mem_size = mem->type >> 8;
+
+    if (size != 4 && size != 8)
+        return false;
+
+    if (mem_size && mem_size != size && inst.menmonic != "lea")
+        throw runtime_error("operand size mismatch for " + inst.menmonic);
+
+    int flags = it->second.is_fusible ? INSN_FUSIBLE | INSN_PREFIXABLE : INSN_PREFIXABLE;
+
+    // a ds prefix in front of a segment override would be a second override
+    if (mem->segment)
+        flags &= ~INSN_PREFIXABLE;
+
+    // the general and local dynamic models are lea rdi, [rel sym wrt ..tlsgd] followed by a call to __tls_get_addr
+    if (mem->wrt == "..tlsgd" || mem->wrt == "..tlsld")
+    {
+        if (inst.menmonic != "lea" || reg->reg != 7 || size != 8)
+            throw runtime_error(mem->wrt + " is only valid in lea rdi, [rel sym wrt " + mem->wrt + "]");
+
+        out.begin_instruction(0);
+
+        if (mem->wrt == "..tlsgd")
+            out.add(0x66);
+
+        encode_memory(out, 8, opcode_byte, reg->reg, *mem, false);
+        out.end_instruction();
+
+        out.tls_sequence = (mem->wrt == "..tlsgd") ? R_X86_64_TLSGD : R_X86_64_TLSLD;
+
+        return true;
+    }
+
+    out.begin_instruction(is_tls_access(*mem) ? 0 : flags);
+    encode_memory(out, (size == 8) ? 8 : 0, opcode_byte, reg->reg, *mem, it->second.is_relaxable && opcode_byte != 0x89);
+    out.end_instruction();
+
+    return true;
+}
+
+// call [mem] and jmp [mem], through the got these can become direct by the linker
+bool encode_indirect(Output& out, const Instruction& inst, int tls_sequence)
+{
+    if ((inst.menmonic != "call" && inst.menmonic != "jmp") || inst.operands.size() != 1 || !is_memory(inst.operands[0]))
+        return false;
+
+    int mem_size = inst.operands[0].type >> 8;
+
+    if (mem_size && mem_size != 8)
+        throw runtime_error("operand size mismatch for " + inst.menmonic);
+
+    out.begin_instruction(tls_sequence ? 0 : INSN_JUMP);
+    encode_memory(out, 0, 0xff, (inst.menmonic == "call") ? 2 : 4, inst.operands[0], true);
+    out.end_instruction();
+
+    return true;
+}
+
+int immediate_relocation(const Operand& imm, bool wide)
+{
+    if (imm.wrt.empty())
+        return wide ? R_X86_64_64 : R_X86_64_32S;
+
+    if (wide && imm.wrt == "..gotoff")
+        return R_X86_64_GOTOFF64;
+
+    if (wide && imm.wrt == "..gotpc")
+        return R_X86_64_GOTPC64;
+
+    throw runtime_error("wrt " + imm.wrt + " can't be used with this mov");
+}
+
+// mov reg, imm and movabs reg, imm, symbols get the 64 bit form in the large model or when asked for with movabs
+bool encode_mov_immediate(Output& out, const Instruction& inst)
+{
+    if ((inst.menmonic != "mov" && inst.menmonic != "movabs") || inst.operands.size() != 2)
+        return false;
+
+    const Operand& reg = inst.operands[0];
+    const Operand& imm = inst.operands[1];
+
+    if ((reg.type & 0xff) != 2 || imm.type != 1)
+        return false;
+
+    int size = reg.type >> 8;
+    bool has_symbol = !imm.symbol.empty();
+
+    if (size != 4 && size != 8)
+        return false;
+
+    bool wide = inst.menmonic == "movabs" || (has_symbol && (out.large_model || imm.wrt == "..gotoff" || imm.wrt == "..gotpc"));
+
+    if (!has_symbol && size == 8)
+        wide |= (int64_t)imm.imm < INT32_MIN || (int64_t)imm.imm > INT32_MAX;
+
+    if (wide && size != 8)
+        throw runtime_error("64 bit immediates need a 64 bit register");
+
+    if (!has_symbol && size == 4 && ((int64_t)imm.imm < INT32_MIN || (int64_t)imm.imm > UINT32_MAX))
+        throw runtime_error("value doesn't fit in 32 bits");
+
+    out.begin_instruction(INSN_PREFIXABLE);
+
+    int rex = (size == 8) ? 8 : 0;
+
+    if (reg.reg & 8)
+        rex |= 1;
+
+    if (rex)
+        out.add(0x40 | rex);
+
+    // rex.w c7 /0 sign extends a 32 bit immediate, b8+r takes a full one
+    if (size == 8 && !wide)
+    {
+        out.add(0xc7);
+        out.add(0xc0 | (reg.reg & 7));
+    }
+    else
+        out.add(0xb8 + (reg.reg & 7));
+
+    int imm_size = wide ? 8 : 4;
+
+    if (has_symbol)
+    {
+        int type = (size == 4) ? R_X86_64_32 : immediate_relocation(imm, wide);
+
+        if (size == 4 && !imm.wrt.empty())
+            throw runtime_error("wrt " + imm.wrt + " can't be used with this mov");
+
+        out.add_relocation(imm.symbol, type, imm.imm);
+        out.add_imm(0, imm_size);
+    }
+    else
+        out.add_imm(imm.imm, imm_size);
+
+    out.end_instruction();
+
+    return true;
+}
+
+// in the large model a load into another register first puts the address in that register,
+// movabs reg, sym followed by mov reg, [reg]
+void encode_load_through_register(Output& out, const Operand& reg, const Operand& mem)
+{
+    int size = reg.type >> 8;
+
+    out.begin_instruction(INSN_PREFIXABLE);
+    out.add(0x48 | ((reg.reg & 8) ? 1 : 0));
+    out.add(0xb8 + (reg.reg & 7));
+    out.add_relocation(mem.symbol, R_X86_64_64, mem.disp);
+    out.add_imm(0, 8);
+    out.end_instruction();
+
+    Operand address = mem;
+    address.base = reg.reg;
+    address.index = -1;
+    address.disp = 0;
+    address.is_sib = false;
+    address.address_override = false;
+    address.symbol.clear();
+
+    out.begin_instruction(mem.segment ? 0 : INSN_PREFIXABLE);
+    encode_memory(out, (size == 8) ? 8 : 0, 0x8b, reg.reg, address, false);
+    out.end_instruction();
+}
+
+// mov rax, [abs] and mov [abs], rax with a 64 bit address, used for symbols in the large model
+bool encode_mov_offset(Output& out, const Instruction& inst)
+{
+    if ((inst.menmonic != "mov" && inst.menmonic != "movabs") || inst.operands.size() != 2)
+        return false;
+
+    bool store = is_memory(inst.operands[0]);
+    const Operand& reg = inst.operands[store ? 1 : 0];
+    const Operand& mem = inst.operands[store ? 0 : 1];
+
+    if ((reg.type & 0xff) != 2 || !is_memory(mem) || mem.is_relative || mem.base >= 0 || mem.index >= 0)
+        return false;
+
+    if (inst.menmonic == "mov" && (!out.large_model || mem.symbol.empty() || !mem.wrt.empty()))
+        return false;
+
+    int size = reg.type >> 8;
+    int mem_size = mem.type >> 8;
+
+    if (inst.menmonic == "movabs" && (reg.reg != 0 || (size != 4 && size != 8)))
+        throw runtime_error("a 64 bit absolute address can only be used with rax or eax");
+
+    // loads into other registers have that register to spare for the address, stores have none
+    if (reg.reg != 0 || (size != 4 && size != 8))
+    {
+        if (store)
+            throw runtime_error("a store to a 64 bit address can only be from rax or eax");
+
+        if (size != 4 && size != 8)
+            return false;
+
+        if (mem_size && mem_size != size)
+            throw runtime_error("operand size mismatch for " + inst.menmonic);
+
+        encode_load_through_register(out, reg, mem);
+
+        return true;
+    }
+
+    if (mem_size && mem_size != size)
+        throw runtime_error("operand size mismatch for " + inst.menmonic);
+
+    if (!mem.wrt.empty())
+        throw runtime_error("wrt " + mem.wrt + " can't be used with a 64 bit address");
+
+    out.begin_instruction(mem.segment ? 0 : INSN_PREFIXABLE);
+
+    if (mem.segment)
+        out.add(mem.segment);
+
+    if (size == 8)
+        out.add(0x48);
+
+    out.add(store ? 0xa3 : 0xa1);
+
+    if (mem.symbol.empty())
+        out.add_imm((int64_t)mem.disp, 8);
+    else
+    {
+        out.add_relocation(mem.symbol, R_X86_64_64, mem.disp);
+        out.add_imm(0, 8);
+    }
+
+    out.end_instruction();
+
+    return true;
+}
+
+bool is_register(const Operand& op, int size)
+{
+    return (op.type & 0xff) == 2 && (int)(op.type >> 8) == size;
+}
+
+void add_rex(Output& out, int rex)
+{
+    if (rex)
+        out.add(0x40 | rex);
+}
+
+// push r64 and pop r64
+bool encode_push_pop(Output& out, const Instruction& inst)
+{
+    if ((inst.menmonic != "push" && inst.menmonic != "pop") || inst.operands.size() != 1 || !is_register(inst.operands[0], 8))
+        return false;
+
+    int reg = inst.operands[0].reg;
+
+    out.begin_instruction(INSN_PREFIXABLE);
+    add_rex(out, (reg & 8) ? 1 : 0);
+    out.add(((inst.menmonic == "push") ? 0x50 : 0x58) + (reg & 7));
+    out.end_instruction();
+
+    return true;
+}
+
+bool encode_mov_register(Output& out, const Instruction& inst)
+{
+    if (inst.menmonic != "mov" || inst.operands.size() != 2)
+        return false;
+
+    const Operand& dst = inst.operands[0];
+    const Operand& src = inst.operands[1];
+    int size = dst.type >> 8;
+
+    if ((size != 4 && size != 8) || !is_register(dst, size) || !is_register(src, size))
+        return false;
+
+    out.begin_instruction(INSN_PREFIXABLE);
+    add_rex(out, ((size == 8) ? 8 : 0) | ((src.reg & 8) ? 4 : 0) | ((dst.reg & 8) ? 1 : 0));
+    out.add(0x89);
+    out.add(0xc0 | (src.reg & 7) << 3 | (dst.reg & 7));
+    out.end_instruction();
+
+    return true;
+}
+
+// the /n of the 83 and 81 group
+unordered_map<string, int> alu_extensions =
+{
+    {"add", 0}, {"or", 1}, {"adc", 2}, {"sbb", 3}, {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7},
+};
+
+// op [mem], imm for the 81, 83 and c7 groups, the immediate comes after a rip relative displacement
+void encode_memory_immediate(Output& out, int size, uint8_t opcode_byte, int extension, const Operand& mem, int64_t value, int imm_size)
+{
+    Operand target = mem;
+
+    if (target.is_relative && !target.symbol.empty())
+        target.disp -= imm_size;
+
+    // memory with an immediate never fuses with a following jcc
+    out.begin_instruction((mem.segment || is_tls_access(mem)) ? 0 : INSN_PREFIXABLE);
+    encode_memory(out, (size == 8) ? 8 : 0, opcode_byte, extension, target, false);
+    out.add_imm(value, imm_size);
+    out.end_instruction();
+}
+
+// alu reg, imm and alu [mem], imm, a sign extended imm8 when the value fits
+bool encode_alu_immediate(Output& out, const Instruction& inst)
+{
+    auto it = alu_extensions.find(inst.menmonic);
+
+    if (it == alu_extensions.end() || inst.operands.size() != 2)
+        return false;
+
+    const Operand& dst = inst.operands[0];
+    const Operand& imm = inst.operands[1];
+    int size = dst.type >> 8;
+
+    if (imm.type != 1 || !(is_register(dst, size) || is_memory(dst)))
+        return false;
+
+    if (is_memory(dst) && !size)
+        throw runtime_error("operation size not specified for " + inst.menmonic + " [mem], imm");
+
+    if (size != 4 && size != 8)
+        return false;
+
+    if (!imm.symbol.empty())
+        throw runtime_error(inst.menmonic + " with a symbol immediate isn't supported");
+
+    int64_t value = imm.imm;
+
+    // 32 bit operations take any 32 bit pattern, 64 bit ones sign extend it
+    if (size == 4 && value > INT32_MAX && value <= UINT32_MAX)
+        value = (int32_t)value;
+
+    if (value < INT32_MIN || value > INT32_MAX)
+        throw runtime_error("value doesn't fit in 32 bits");
+
+    bool is_byte = value >= INT8_MIN && value <= INT8_MAX;
+
+    if (is_memory(dst))
+    {
+        encode_memory_immediate(out, size, is_byte ? 0x83 : 0x81, it->second, dst, value, is_byte ? 1 : 4);
+
+        return true;
+    }
+
+    bool is_fusible = it->second == 0 || it->second == 4 || it->second == 5 || it->second == 7;
+
+    out.begin_instruction(is_fusible ? INSN_FUSIBLE | INSN_PREFIXABLE : INSN_PREFIXABLE);
+    add_rex(out, ((size == 8) ? 8 : 0) | ((dst.reg & 8) ? 1 : 0));
+    out.add(is_byte ? 0x83 : 0x81);
+    out.add(0xc0 | it->second << 3 | (dst.reg & 7));
+    out.add_imm(value, is_byte ? 1 : 4);
+    out.end_instruction();
+
+    return true;
+}
+
+// mov [mem], imm, rex.w c7 /0 sign extends the 32 bit immediate
+bool encode_mov_memory_immediate(Output& out, const Instruction& inst)
+{
+    if (inst.menmonic != "mov" || inst.operands.size() != 2 || !is_memory(inst.operands[0]) || inst.operands[1].type != 1)
+        return false;
+
+    const Operand& mem = inst.operands[0];
+    const Operand& imm = inst.operands[1];
+    int size = mem.type >> 8;
+
+    if (!size)
+        throw runtime_error("operation size not specified for mov [mem], imm");
+
+    if (size != 4 && size != 8)
+        return false;
+
+    if (!imm.symbol.empty())
+        throw runtime_error("mov [mem], imm with a symbol immediate isn't supported");
+
+    int64_t value = imm.imm;
+
+    if (value < INT32_MIN || value > ((size == 4) ? (int64_t)UINT32_MAX : (int64_t)INT32_MAX))
+        throw runtime_error("value doesn't fit in 32 bits");
+
+    encode_memory_immediate(out, size, 0xc7, 0, mem, value, 4);
+
+    return true;
+}
+
+// alu reg, reg in the store direction, the 8 bit forms are one opcode below
+unordered_map<string, uint8_t> register_opcodes =
+{
+    {"add", 0x01}, {"or", 0x09}, {"adc", 0x11}, {"sbb", 0x19}, {"and", 0x21}, {"sub", 0x29}, {"xor", 0x31}, {"cmp", 0x39}, {"test", 0x85},
+};
+
+bool encode_alu_register(Output& out, const Instruction& inst)
+{
+    auto it = register_opcodes.find(inst.menmonic);
+
+    if (it == register_opcodes.end() || inst.operands.size() != 2)
+        return false;
+
+    const Operand& dst = inst.operands[0];
+    const Operand& src = inst.operands[1];
+    int size = dst.type >> 8;
+
+    if ((size != 1 && size != 2 && size != 4 && size != 8) || !is_register(dst, size) || !is_register(src, size))
+        return false;
+
+    // the parser gives ah .. bh the numbers of spl .. dil, which only differ by a rex prefix
+    if (size == 1 && ((dst.reg >= 4 && dst.reg < 8) || (src.reg >= 4 && src.reg < 8)))
+        return false;
+
+    bool is_fusible = inst.menmonic == "add" || inst.menmonic == "and" || inst.menmonic == "sub" || inst.menmonic == "cmp" || inst.menmonic == "test";
+
+    out.begin_instruction(is_fusible ? INSN_FUSIBLE | INSN_PREFIXABLE : INSN_PREFIXABLE);
+
+    if (size == 2)
+        out.add(0x66);
+
+    add_rex(out, ((size == 8) ? 8 : 0) | ((src.reg & 8) ? 4 : 0) | ((dst.reg & 8) ? 1 : 0));
+    out.add((size == 1) ? it->second - 1 : it->second);
+    out.add(0xc0 | (src.reg & 7) << 3 | (dst.reg & 7));
+    out.end_instruction();
+
+    return true;
+}
+
+// the /n of the f7 group
+unordered_map<string, int> unary_extensions =
+{
+    {"not", 2}, {"neg", 3}, {"mul", 4}, {"imul", 5}, {"div", 6}, {"idiv", 7},
+};
+
+// not, neg, mul, imul, div and idiv of a register or [mem]
+bool encode_unary(Output& out, const Instruction& inst)
+{
+    auto it = unary_extensions.find(inst.menmonic);
+
+    if (it == unary_extensions.end() || inst.operands.size() != 1)
+        return false;
+
+    const Operand& op = inst.operands[0];
+    int size = op.type >> 8;
+
+    if (is_memory(op) && !size)
+        throw runtime_error("operation size not specified for " + inst.menmonic + " [mem]");
+
+    if ((size != 4 && size != 8) || !(is_register(op, size) || is_memory(op)))
+        return false;
+
+    if (is_memory(op))
+    {
+        out.begin_instruction((op.segment || is_tls_access(op)) ? 0 : INSN_PREFIXABLE);
+        encode_memory(out, (size == 8) ? 8 : 0, 0xf7, it->second, op, false);
+        out.end_instruction();
+
+        return true;
+    }
+
+    out.begin_instruction(INSN_PREFIXABLE);
+    add_rex(out, ((size == 8) ? 8 : 0) | ((op.reg & 8) ? 1 : 0));
+    out.add(0xf7);
+    out.add(0xc0 | it->second << 3 | (op.reg & 7));
+    out.end_instruction();
+
+    return true;
+}
+
+// instructions without operands
+unordered_map<string, vector<uint8_t>> plain_opcodes =
+{
+    {"nop", { 0x90 }}, {"cdq", { 0x99 }}, {"cqo", { 0x48, 0x99 }},
+};
+
+bool encode_plain(Output& out, const Instruction& inst)
+{
+    auto it = plain_opcodes.find(inst.menmonic);
+
+    if (it == plain_opcodes.end() || !inst.operands.empty())
+        return false;
+
+    out.begin_instruction(INSN_PREFIXABLE);
+
+    for (uint8_t byte : it->second)
+        out.add(byte);
+
+    out.end_instruction();
+
+    return true;
+}
+
+bool encode_leave(Output& out, const Instruction& inst)
+{
+    if (inst.menmonic != "leave" || !inst.operands.empty())
+        return false;
+
+    out.begin_instruction(INSN_PREFIXABLE);
+    out.add(0xc9);
+    out.end_instruction();
+
+    return true;
+}
+
+// dwarf numbers of rax .. r15 in encoding order
+const int dwarf_registers[16] = { 0, 2, 1, 3, 7, 6, 4, 5, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+bool is_stack_adjust(const Instruction& inst)
+{
+    return (inst.menmonic == "sub" || inst.menmonic == "add") && inst.operands.size() == 2
+        && is_register(inst.operands[0], 8) && inst.operands[0].reg == 4
+        && inst.operands[1].type == 1 && inst.operands[1].symbol.empty();
+}
+
+bool is_frame_setup(const Instruction& inst)
+{
+    return inst.menmonic == "mov" && inst.operands.size() == 2 && is_register(inst.operands[0], 8) && is_register(inst.operands[1], 8)
+        && inst.operands[0].reg == 5 && inst.operands[1].reg == 4;
+}
+
+bool is_push_pop(const Instruction& inst)
+{
+    return (inst.menmonic == "push" || inst.menmonic == "pop") && inst.operands.size() == 1 && is_register(inst.operands[0], 8);
+}
+
+// auto frames follow the stack through standard prologues and epilogues,
+// pushes in the prologue are register saves and code after a ret is back in the body state,
+// which only needs a row once another instruction of the frame follows
+void infer_cfi(Output& out, const Instruction& inst)
+{
+    FrameState& f = out.frame;
+
+    if (f.in_prologue && !is_frame_setup(inst) && !is_stack_adjust(inst) && inst.menmonic != "push")
+    {
+        f.in_prologue = false;
+        f.body_register = f.cfa_register;
+        f.body_offset = f.cfa_offset;
+        f.body_stack = f.stack_offset;
+    }
+
+    if (is_push_pop(inst))
+    {
+        int reg = inst.operands[0].reg;
+        bool push = inst.menmonic == "push";
+
+        f.stack_offset += push ? 8 : -8;
+
+        if (!push && reg == 5 && f.cfa_register == 6)
+            out.add_cfi(CFI_DEF_CFA, 7, f.stack_offset);
+        else if (f.cfa_register == 7)
+            out.add_cfi(CFI_DEF_CFA_OFFSET, 0, f.stack_offset);
+
+        if (push && f.in_prologue)
+            out.add_cfi(CFI_OFFSET, dwarf_registers[reg], -f.stack_offset);
+    }
+    else if (is_frame_setup(inst))
+    {
+        if (f.cfa_register == 7)
+            out.add_cfi(CFI_DEF_CFA_REGISTER, 6, 0);
+    }
+    else if (is_stack_adjust(inst))
+    {
+        int64_t value = inst.operands[1].imm;
+
+        f.stack_offset += (inst.menmonic == "sub") ? value : -value;
+
+        if (f.cfa_register == 7)
+            out.add_cfi(CFI_DEF_CFA_OFFSET, 0, f.stack_offset);
+    }
+    else if (inst.menmonic == "leave")
+    {
+        if (f.cfa_register == 6)
+        {
+            f.stack_offset = f.cfa_offset - 8;
+            out.add_cfi(CFI_DEF_CFA, 7, f.stack_offset);
+        }
+    }
+    else if (inst.menmonic == "ret")
+    {
+        f.restore_pending = f.cfa_register != f.body_register || f.cfa_offset != f.body_offset;
+        f.stack_offset = f.body_stack;
+    }
+}
+
+bool encode(Output& out, const Instruction& inst)
+{
+    int tls_sequence = out.tls_sequence;
+    out.tls_sequence = 0;
+
+    uint64_t start = out.current_section->size();
+    size_t start_fragment = out.current_section->fragments.size();
+
+    if (out.frame.restore_pending && out.frame.section == out.current_section)
+    {
+        out.frame.restore_pending = false;
+        out.add_cfi(CFI_DEF_CFA, out.frame.body_register, out.frame.body_offset);
+    }
+
+    bool encoded = encode_branch(out, inst) || encode_call(out, inst, tls_sequence) || encode_ret(out, inst)
+        || encode_mov_immediate(out, inst) || encode_mov_offset(out, inst) || encode_load(out, inst) || encode_indirect(out, inst, tls_sequence)
+        || encode_push_pop(out, inst) || encode_mov_register(out, inst) || encode_alu_immediate(out, inst) || encode_leave(out, inst)
+        || encode_mov_memory_immediate(out, inst) || encode_alu_register(out, inst) || encode_unary(out, inst) || encode_plain(out, inst);
+
+    if (!encoded)
+        return false;
+
+    if (!out.auto_cfi || (out.frame.section && !out.frame.is_auto))
+        return true;
+
+    // a label right in front of push rbp starts a function even when it isn't exported
+    Symbol* label = out.frame.label;
+
+    if (inst.menmonic == "push" && is_push_pop(inst) && inst.operands[0].reg == 5
+        && label && label->section == out.current_section && label->offset == start && label->fragment == start_fragment)
+    {
+        Section* sec = out.frame.section;
+        bool started = sec && sec->frames.back().start == start && sec->frames.back().start_fragment == start_fragment;
+
+        if (!started)
+            out.start_frame(true, start, start_fragment);
+    }
+
+    if (out.frame.section == out.current_section)
+        infer_cfi(out, inst);
+
+    return true;
+}
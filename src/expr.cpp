@@ -2,29 +2,31 @@
 
 bool Constant::is_symbolic() const
 {
-    return !symbol.empty();
+    return !symbol.empty() || !minus.empty();
+}
+
+bool Constant::is_difference() const
+{
+    return !minus.empty();
 }
 
 Constant Constant::operator+(const Constant& other) const
 {
-    if (other.is_symbolic() && is_symbolic())
+    if (!other.symbol.empty() && !symbol.empty())
         throw std::runtime_error("cannot add two symbols");
 
-    return { other.is_symbolic() ? other.symbol : symbol, offset + other.offset };
+    if (other.is_difference() && is_difference())
+        throw std::runtime_error("cannot subtract more than one symbol");
+
+    return { other.symbol.empty() ? symbol : other.symbol, other.minus.empty() ? minus : other.minus, offset + other.offset };
 }
 
 Constant Constant::operator-(const Constant& other) const
 {
-    if (other.is_symbolic())
-        throw std::runtime_error("cannot subtract symbol");
-
-    return { symbol, offset - other.offset };
+    return *this + -other;
 }
 
 Constant Constant::operator-() const
 {
-    if (is_symbolic())
-        throw std::runtime_error("cannot negate symbol");
-
-    return { "", -offset };
-}
\ No newline at end of file
+    return { minus, symbol, -offset };
+}
@@ -0,0 +1,535 @@
+#include <algorithm>
+#include <elf.h>
+
+#include "output.h"
+
+using namespace std;
+
+// after this many sweeps loop heads keep their alignment decision so that layout converges
+const int max_loop_sweeps = 8;
+
+uint64_t branch_size(const Fragment& frag)
+{
+    if (!frag.is_long)
+        return 2;
+
+    return (frag.cond < 0) ? 5 : 6;
+}
+
+// position of something at offset behind fragment fragments given the fragment sizes of the last sweep
+uint64_t address_of(const Section* sec, uint64_t offset, size_t fragment)
+{
+    if (fragment == 0)
+        return offset;
+
+    const Fragment& prev = sec->fragments[fragment - 1];
+
+    return offset + prev.address + prev.size - prev.offset;
+}
+
+uint64_t symbol_address(const Section* sec, const Symbol* sym)
+{
+    return address_of(sec, sym->offset, sym->fragment);
+}
+
+// an exported symbol of default visibility can be interposed, so references to it stay for the linker
+bool binds_locally(const Section* sec, const Symbol* sym)
+{
+    return sym->is_defined && sym->section == sec && (!sym->is_exported || sym->visibility != STV_DEFAULT);
+}
+
+bool is_local_target(const Section* sec, const Fragment& frag)
+{
+    return binds_locally(sec, frag.target);
+}
+
+void mark_loops(Section* sec)
+{
+    auto& frags = sec->fragments;
+
+    for (size_t i = 0; i < frags.size(); i++)
+    {
+        if (frags[i].type != FRAG_BRANCH || frags[i].addend || !is_local_target(sec, frags[i]))
+            continue;
+
+        size_t head = frags[i].target->fragment;
+
+        // the target was defined after the branch, so it jumps forward
+        if (head == 0 || head > i)
+            continue;
+
+        Fragment& frag = frags[head - 1];
+
+        if (frag.type == FRAG_LOOP_ALIGN && frag.offset == frags[i].target->offset)
+            frag.loop_end = i;
+    }
+}
+
+// aligning pays off only if it is cheap enough and saves a fetch block over the loop body
+bool should_align_loop(const Section* sec, const Fragment& frag)
+{
+    const Fragment& end = sec->fragments[frag.loop_end];
+
+    // where the head would be without any padding, some of which may have gone into prefixes
+    uint64_t address = frag.address + frag.size - frag.padding;
+
+    uint64_t body = end.address + end.size - (frag.address + frag.size);
+    uint64_t padding = -address & (frag.alignment - 1);
+
+    if (padding == 0 || padding > frag.max_skip)
+        return false;
+
+    uint64_t blocks = ((address & (frag.alignment - 1)) + body + frag.alignment - 1) / frag.alignment;
+    uint64_t aligned_blocks = (body + frag.alignment - 1) / frag.alignment;
+
+    return aligned_blocks < blocks;
+}
+
+// padding that keeps [address, address + length) from crossing or ending on a boundary
+uint64_t boundary_padding(uint64_t address, uint64_t length, uint64_t boundary)
+{
+    if (!boundary || length > boundary)
+        return 0;
+
+    if (address / boundary == (address + length) / boundary)
+        return 0;
+
+    return -address & (boundary - 1);
+}
+
+// a fusible instruction directly followed by a jcc, both must stay on the same side of a boundary
+bool is_fused_pair(const vector<Fragment>& frags, size_t i)
+{
+    if (frags[i].type != FRAG_BOUNDARY || !frags[i].is_fusible || i + 1 == frags.size())
+        return false;
+
+    const Fragment& next = frags[i + 1];
+
+    return next.type == FRAG_BRANCH && next.cond >= 0 && next.offset == frags[i].offset + frags[i].length;
+}
+
+// spreads padding over the instructions right in front of it as redundant prefixes, returns how much fit
+uint64_t absorb_padding(vector<Fragment>& frags, const vector<size_t>& run, uint64_t padding)
+{
+    uint64_t absorbed = 0;
+    bool room = true;
+
+    while (absorbed < padding && room)
+    {
+        room = false;
+
+        for (size_t j = run.size(); j-- > 0 && absorbed < padding;)
+        {
+            Fragment& frag = frags[run[j]];
+
+            if (frag.size < frag.max_skip)
+            {
+                frag.size++;
+                absorbed++;
+                room = true;
+            }
+        }
+    }
+
+    uint64_t shift = frags[run[0]].address - frags[run[0]].offset;
+
+    for (size_t j : run)
+    {
+        frags[j].address = frags[j].offset + shift;
+        shift += frags[j].size;
+    }
+
+    return absorbed;
+}
+
+void sweep(Section* sec, uint64_t boundary)
+{
+    auto& frags = sec->fragments;
+    uint64_t shift = 0;
+
+    // prefix fragments since the last fragment of another kind
+    vector<size_t> run;
+
+    for (size_t i = 0; i < frags.size(); i++)
+    {
+        Fragment& frag = frags[i];
+
+        frag.address = frag.offset + shift;
+
+        switch (frag.type)
+        {
+        case FRAG_ALIGN:
+            frag.padding = -frag.address & (frag.alignment - 1);
+
+            if (frag.padding > frag.max_skip)
+                frag.padding = 0;
+
+            break;
+
+        case FRAG_LOOP_ALIGN:
+            frag.padding = frag.is_active ? (-frag.address & (frag.alignment - 1)) : 0;
+            break;
+
+        case FRAG_BRANCH:
+            if (i && is_fused_pair(frags, i - 1))
+                frag.padding = 0;
+            else
+                frag.padding = boundary_padding(frag.address, branch_size(frag), boundary);
+
+            break;
+
+        case FRAG_BOUNDARY:
+            if (!frag.is_fusible)
+                frag.padding = boundary_padding(frag.address, frag.length, boundary);
+            else if (is_fused_pair(frags, i))
+            {
+                frag.padding = boundary_padding(frag.address, frag.length + branch_size(frags[i + 1]), boundary);
+
+                // its own prefixes would move the pair along with the padding
+                if (!run.empty() && frags[run.back()].offset == frag.offset)
+                    run.pop_back();
+            }
+            else
+            {
+                // without a jcc behind it the instruction stays part of the run, taking no prefixes itself here
+                frag.padding = frag.size = 0;
+                run.push_back(i);
+
+                continue;
+            }
+
+            break;
+
+        case FRAG_LITERAL:
+            frag.padding = frag.is_active ? (-frag.address & (frag.alignment - 1)) : 0;
+            break;
+
+        case FRAG_PREFIX:
+            frag.size = 0;
+            run.push_back(i);
+
+            continue;
+        }
+
+        if (frag.padding && !run.empty() && sec->attr.exec)
+        {
+            uint64_t absorbed = absorb_padding(frags, run, frag.padding);
+
+            shift += absorbed;
+            frag.address += absorbed;
+            frag.size = frag.padding - absorbed;
+        }
+        else
+            frag.size = frag.padding;
+
+        if (frag.type == FRAG_BRANCH)
+            frag.size += branch_size(frag);
+        else if (frag.type == FRAG_LITERAL && frag.is_active)
+            frag.size += frag.length;
+
+        shift += frag.size;
+        run.clear();
+
+        // the prefix fragment of a fused pair sits right in front of its boundary fragment
+        if (frag.type == FRAG_BOUNDARY && i && frags[i - 1].type == FRAG_PREFIX && frags[i - 1].offset == frag.offset)
+            frags[i - 1].address = frag.address;
+    }
+}
+
+bool relax(Section* sec, bool update_loops)
+{
+    bool changed = false;
+
+    for (auto& frag : sec->fragments)
+    {
+        if (frag.type == FRAG_BRANCH && !frag.is_long)
+        {
+            if (!is_local_target(sec, frag))
+                frag.is_long = true;
+            else
+            {
+                int64_t disp = symbol_address(sec, frag.target) + frag.addend - (frag.address + frag.size);
+
+                if (disp < INT8_MIN || disp > INT8_MAX)
+                    frag.is_long = true;
+            }
+
+            changed |= frag.is_long;
+        }
+        else if (frag.type == FRAG_LOOP_ALIGN && frag.loop_end != SIZE_MAX && update_loops)
+        {
+            bool active = should_align_loop(sec, frag);
+
+            if (active != frag.is_active)
+            {
+                frag.is_active = active;
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
+
+void emit_branch(Section* sec, const Fragment& frag, ChunkedBytes& bytes, vector<Relocation>& rels)
+{
+    bool local = is_local_target(sec, frag);
+    int64_t disp = 0;
+
+    if (local)
+        disp = symbol_address(sec, frag.target) + frag.addend - (frag.address + frag.size);
+
+    if (!frag.is_long)
+    {
+        bytes.push_back((frag.cond < 0) ? 0xeb : 0x70 + frag.cond);
+        bytes.push_back(disp);
+
+        return;
+    }
+
+    if (frag.cond < 0)
+        bytes.push_back(0xe9);
+    else
+    {
+        bytes.push_back(0x0f);
+        bytes.push_back(0x80 + frag.cond);
+    }
+
+    if (!local)
+        rels.push_back({ frag.target, nullptr, frag.address + frag.size - 4, frag.addend - 4, R_X86_64_PLT32 });
+
+    for (int i = 0; i < 4; i++)
+        bytes.push_back(disp >> (i * 8));
+}
+
+// size in bytes of the field a pc relative relocation patches, 0 for other types
+int pc_relative_size(int type)
+{
+    switch (type)
+    {
+    case R_X86_64_PC8: return 1;
+    case R_X86_64_PC16: return 2;
+    case R_X86_64_PC32: return 4;
+    case R_X86_64_PLT32: return 4;
+    case R_X86_64_PC64: return 8;
+    default: return 0;
+    }
+}
+
+void Output::layout()
+{
+    end_item();
+    resolve_literals();
+
+    if (frame.section)
+    {
+        if (!frame.is_auto)
+            throw runtime_error("missing .cfi_endproc");
+
+        end_frame();
+    }
+
+    for (auto& sec : sections)
+        if (!sec->fragments.empty())
+            layout(sec);
+
+    for (auto& sec : sections)
+        resolve_relocations(sec);
+
+    resolve_sizes();
+    place_large_data();
+}
+
+void Output::layout(Section* sec)
+{
+    mark_loops(sec);
+
+    int sweeps = 0;
+
+    do
+        sweep(sec, branch_boundary);
+    while (relax(sec, ++sweeps < max_loop_sweeps));
+
+    ChunkedBytes bytes;
+    vector<Relocation> rels;
+
+    size_t r = 0;
+    uint64_t pos = 0;
+    uint64_t shift = 0;
+
+    for (auto& frag : sec->fragments)
+    {
+        for (; r < sec->rels.size() && sec->rels[r].offset < frag.offset; r++)
+        {
+            rels.push_back(sec->rels[r]);
+            rels.back().offset += shift;
+        }
+
+        bytes.append(sec->bytes, pos, frag.offset);
+        sec->bytes.release(frag.offset);
+        pos = frag.offset;
+
+        if (frag.type == FRAG_BRANCH)
+        {
+            append_nops(bytes, frag.size - branch_size(frag), tune->max_nop_size);
+            emit_branch(sec, frag, bytes, rels);
+        }
+        else if (frag.type == FRAG_PREFIX)
+            bytes.append(frag.size, 0x3e);
+        else if (frag.literal != SIZE_MAX)
+        {
+            if (frag.is_active)
+                bytes.append(literals[frag.literal].bytes.data(), frag.size);
+        }
+        else if (sec->attr.exec)
+            append_nops(bytes, frag.size, tune->max_nop_size);
+        else
+            bytes.append(frag.size, frag.fill);
+
+        shift += frag.size;
+    }
+
+    for (; r < sec->rels.size(); r++)
+    {
+        rels.push_back(sec->rels[r]);
+        rels.back().offset += shift;
+    }
+
+    bytes.append(sec->bytes, pos, sec->bytes.size());
+
+    for (auto& sym : sec->labels)
+    {
+        sym->offset = symbol_address(sec, sym);
+        sym->fragment = 0;
+    }
+
+    for (auto& row : sec->lines)
+    {
+        row.offset = address_of(sec, row.offset, row.fragment);
+        row.fragment = 0;
+    }
+
+    for (auto& f : sec->frames)
+    {
+        f.start = address_of(sec, f.start, f.start_fragment);
+        f.end = address_of(sec, f.end, f.end_fragment);
+        f.start_fragment = f.end_fragment = 0;
+
+        for (auto& insn : f.insns)
+        {
+            insn.offset = address_of(sec, insn.offset, insn.fragment);
+            insn.fragment = 0;
+        }
+    }
+
+    sec->bytes.swap(bytes);
+    sec->rels.swap(rels);
+    sec->fragments.clear();
+}
+
+void patch_field(Section* sec, uint64_t offset, int64_t value, int size)
+{
+    uint8_t field[8];
+
+    for (int i = 0; i < size; i++)
+        field[i] = value >> (i * 8);
+
+    sec->bytes.write(offset, field, size);
+}
+
+// pc relative references to symbols in the same section that bind locally are known once layout is done, so they are patched here
+void Output::resolve_relocations(Section* sec)
+{
+    size_t kept = 0;
+
+    for (auto& rel : sec->rels)
+    {
+        int size = pc_relative_size(rel.type);
+
+        if (rel.minus)
+        {
+            Symbol* sym = rel.sym;
+            Symbol* sub = rel.minus;
+
+            if (!sub->is_defined)
+                throw runtime_error("symbol '" + sub->name + "' is undefined");
+
+            // both ends in one section, the difference is a plain number
+            if (sym->is_defined && sym->section == sub->section)
+            {
+                int64_t value = sym->offset - sub->offset + rel.addend;
+
+                if (size < 8 && (value < -(1ll << (size * 8 - 1)) || value >= (1ll << (size * 8))))
+                    throw runtime_error("difference of '" + sym->name + "' and '" + sub->name + "' is out of range");
+
+                patch_field(sec, rel.offset, value, size);
+
+                continue;
+            }
+
+            // sym - sub + a is sym + (a + P - sub) - P when sub is in the section being relocated
+            if (sub->section != sec)
+                throw runtime_error("cannot subtract '" + sub->name + "', it is in another section");
+
+            rel.addend += rel.offset - sub->offset;
+            rel.minus = nullptr;
+        }
+
+        if (!size || !rel.sym || !binds_locally(sec, rel.sym))
+        {
+            sec->rels[kept++] = rel;
+            continue;
+        }
+
+        int64_t value = rel.sym->offset + rel.addend - rel.offset;
+
+        if (size < 8 && (value < -(1ll << (size * 8 - 1)) || value >= (1ll << (size * 8 - 1))))
+            throw runtime_error("reference to '" + rel.sym->name + "' is out of range");
+
+        patch_field(sec, rel.offset, value, size);
+    }
+
+    sec->rels.resize(kept);
+}
+
+void Output::resolve_sizes()
+{
+    for (auto& size : sizes)
+    {
+        if (!size.end->is_defined || !size.start->is_defined || size.end->section != size.start->section)
+            throw runtime_error("size of '" + size.sym->name + "' must be a difference of labels in one section");
+
+        size.sym->size = size.end->offset - size.start->offset + size.offset;
+    }
+
+    if (!auto_sizes)
+        return;
+
+    // exported labels without a size run to the next exported label in their section or to its end
+    vector<Symbol*> labels;
+
+    for (auto& sym : symbols)
+        if (sym->is_exported && sym->is_defined)
+            labels.push_back(sym);
+
+    sort(labels.begin(), labels.end(), [](const Symbol* a, const Symbol* b)
+    {
+        return (a->section != b->section) ? a->section < b->section : a->offset < b->offset;
+    });
+
+    for (size_t i = 0; i < labels.size(); i++)
+    {
+        Symbol* sym = labels[i];
+
+        if (!sym->type)
+            sym->type = sym->section->attr.exec ? STT_FUNC : STT_OBJECT;
+
+        if (sym->has_size)
+            continue;
+
+        bool last = i + 1 == labels.size() || labels[i + 1]->section != sym->section;
+
+        sym->size = (last ? sym->section->size() : labels[i + 1]->offset) - sym->offset;
+        sym->has_size = true;
+    }
+}
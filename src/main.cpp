@@ -1,12 +1,314 @@
 #include <iostream>
 #include <fstream>
+#include <unistd.h>
 
 #include "parser.h"
+#include "encoder.h"
+#include "output.h"
+#include "writer.h"
+#include "dwarf.h"
 
 using namespace std;
 
+size_t assemble(Output& out, istream& in)
+{
+    size_t errors = 0;
+    size_t line_number = 0;
+    string line;
+
+    while (getline(in, line))
+    {
+        line_number++;
+
+        string label;
+        Directive dir;
+        Instruction inst;
+
+        try
+        {
+            TokenStream ts(line);
+
+            if (parse_label(ts, label))
+                out.define_symbol(label);
+
+            uint64_t count = 1;
+            bool has_times = parse_times(ts, count);
+
+            if (parse_directive(ts, dir))
+                out.repeat(count, [&]() { apply_directive(out, dir); });
+            else if (parse_instruction(ts, inst))
+            {
+                out.add_line(line_number);
+                out.repeat(count, [&]()
+                {
+                    if (!encode(out, inst))
+                        throw runtime_error("unable to encode '" + inst.menmonic + "'");
+                });
+            }
+            else if (has_times)
+                throw runtime_error("expected instruction or data after times");
+        }
+        catch (const exception& e)
+        {
+            errors++;
+            cerr << "\e[91merror:\e[0m " << line_number << ": " << e.what() << '\n';
+        }
+    }
+
+    return errors;
+}
+
+// a whole non-negative number after an option, like the 4 of -j4
+bool parse_option_number(const string& text, int& value)
+{
+    try
+    {
+        size_t end;
+        value = stoi(text, &end);
+
+        return end == text.size() && value >= 0;
+    }
+    catch (const exception&)
+    {
+        return false;
+    }
+}
+
+string get_output_name(const string& filename)
+{
+    size_t dot = filename.rfind(".");
+
+    if (dot != string::npos)
+        return filename.substr(0, dot) + ".o";
+
+    return filename + ".o";
+}
+
 int main(int argc, char** argv)
 {
+    const TuningProfile* tune = get_tuning_profile("generic");
+    string filename;
+    string output_name;
+    bool dump = false;
+    string write_mode = "writev";
+    unsigned threads = 1;
+    int loop_align = -1;
+    int function_align = -1;
+    bool align_branches = false;
+    bool pad_with_prefixes = false;
+    bool large_model = false;
+    int large_data_threshold = -1;
+    bool auto_sizes = false;
+    bool debug_lines = false;
+    bool auto_cfi = false;
+    bool function_sections = false;
+    bool merge_constants = false;
+    bool dedup_literals = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg[0] != '-')
+        {
+            if (!filename.empty())
+            {
+                cerr << "\e[91merror:\e[0m more than one input file specified\n";
+                return 1;
+            }
+
+            filename = arg;
+        }
+        else if (arg == "-o")
+        {
+            if (i + 1 == argc)
+            {
+                cerr << "\e[91merror:\e[0m missing file name after -o\n";
+                return 1;
+            }
+
+            output_name = argv[++i];
+        }
+        else if (arg == "-d")
+            dump = true;
+        else if (arg.rfind("-j", 0) == 0)
+        {
+            int count;
+
+            if (!parse_option_number(arg.substr(2), count))
+            {
+                cerr << "\e[91merror:\e[0m invalid thread count in '" << arg << "'\n";
+                return 1;
+            }
+
+            threads = max(count, 1);
+        }
+        else if (arg.rfind("-fwrite-mode=", 0) == 0)
+        {
+            write_mode = arg.substr(13);
+
+            if (write_mode != "writev" && write_mode != "mmap" && write_mode != "pwrite")
+            {
+                cerr << "\e[91merror:\e[0m unknown write mode '" << write_mode << "'\n";
+                return 1;
+            }
+        }
+        else if (arg == "-mbranches-within-32B-boundaries")
+            align_branches = true;
+        else if (arg == "-mpad-with-prefixes")
+            pad_with_prefixes = true;
+        else if (arg == "-g")
+            debug_lines = true;
+        else if (arg == "-fauto-symbol-sizes")
+            auto_sizes = true;
+        else if (arg == "-fauto-cfi")
+            auto_cfi = true;
+        else if (arg == "-ffunction-sections")
+            function_sections = true;
+        else if (arg == "-fmerge-constants")
+            merge_constants = true;
+        else if (arg == "-fdedup-literals")
+            dedup_literals = true;
+        else if (arg == "-mcmodel=small")
+            large_model = false;
+        else if (arg == "-mcmodel=large")
+            large_model = true;
+        else if (arg.rfind("-mlarge-data-threshold=", 0) == 0)
+        {
+            if (!parse_option_number(arg.substr(23), large_data_threshold))
+            {
+                cerr << "\e[91merror:\e[0m invalid large data threshold in '" << arg << "'\n";
+                return 1;
+            }
+        }
+        else if (arg == "-falign-loops")
+            loop_align = 0;
+        else if (arg.rfind("-falign-loops=", 0) == 0)
+        {
+            if (!parse_option_number(arg.substr(14), loop_align))
+            {
+                cerr << "\e[91merror:\e[0m invalid loop alignment in '" << arg << "'\n";
+                return 1;
+            }
+        }
+        else if (arg == "-falign-functions")
+            function_align = 0;
+        else if (arg.rfind("-falign-functions=", 0) == 0)
+        {
+            if (!parse_option_number(arg.substr(18), function_align))
+            {
+                cerr << "\e[91merror:\e[0m invalid function alignment in '" << arg << "'\n";
+                return 1;
+            }
+        }
+        else if (arg.rfind("-mtune=", 0) == 0)
+        {
+            tune = get_tuning_profile(arg.substr(7));
+
+            if (!tune)
+            {
+                cerr << "\e[91merror:\e[0m unknown tuning profile '" << arg.substr(7) << "'\n";
+                return 1;
+            }
+        }
+        else
+        {
+            cerr << "\e[91merror:\e[0m unknown option '" << arg << "'\n";
+            return 1;
+        }
+    }
+
+    Output out(tune);
+
+    if (loop_align >= 0)
+        out.loop_align = loop_align ? loop_align : tune->loop_align;
+
+    if (function_align >= 0)
+        out.function_align = function_align ? function_align : tune->function_align;
+
+    if (large_data_threshold >= 0)
+        out.large_data_threshold = large_data_threshold;
+
+    if (align_branches)
+        out.branch_boundary = 32;
+
+    out.pad_with_prefixes = pad_with_prefixes;
+    out.large_model = large_model;
+    out.auto_sizes = auto_sizes;
+    out.debug_lines = debug_lines;
+    out.auto_cfi = auto_cfi;
+    out.function_sections = function_sections;
+    out.merge_constants = merge_constants;
+    out.dedup_literals = dedup_literals;
+
+    if (out.loop_align & (out.loop_align - 1))
+    {
+        cerr << "\e[91merror:\e[0m loop alignment must be a power of two\n";
+        return 1;
+    }
+
+    if (out.function_align & (out.function_align - 1))
+    {
+        cerr << "\e[91merror:\e[0m function alignment must be a power of two\n";
+        return 1;
+    }
+
+    if (!filename.empty())
+    {
+        ifstream file(filename);
+
+        if (!file.is_open())
+        {
+            cerr << "\e[91merror:\e[0m could not open file\n";
+            return 1;
+        }
+
+        if (assemble(out, file))
+            return 1;
+
+        try
+        {
+            out.layout();
+
+            if (debug_lines)
+            {
+                char cwd[4096];
+                add_debug_lines(out, filename, getcwd(cwd, sizeof(cwd)) ? cwd : ".");
+            }
+
+            bool has_frames = false;
+
+            for (auto& sec : out.sections)
+                has_frames |= !sec->frames.empty();
+
+            if (has_frames)
+                add_eh_frame(out);
+
+            if (dump)
+                out.dump();
+
+            ElfWriter writer(out, filename, threads);
+            writer.build();
+
+            if (output_name.empty())
+                output_name = get_output_name(filename);
+
+            if (write_mode == "mmap")
+                writer.write_mapped(output_name);
+            else if (write_mode == "pwrite")
+                writer.write_positioned(output_name);
+            else
+                writer.write(output_name);
+        }
+        catch (const exception& e)
+        {
+            cerr << "\e[91merror:\e[0m " << e.what() << '\n';
+            return 1;
+        }
+
+        return 0;
+    }
+
     string input;
 
     while (true)
@@ -16,18 +318,26 @@ int main(int argc, char** argv)
         if (!getline(cin, input) || input == "q")
             break;
 
-        TokenStream ts(input);
-
         string label;
-
-        if (parse_label(ts, label))
-            cout << "label: " << label << endl;
-
+        Directive dir;
         Instruction inst;
 
         try
         {
-            if (parse_instruction(ts, inst))
+            TokenStream ts(input);
+
+            if (parse_label(ts, label))
+            {
+                out.define_symbol(label);
+                cout << "label: " << label << endl;
+            }
+
+            if (parse_directive(ts, dir))
+            {
+                apply_directive(out, dir);
+                cout << "directive: " << dir.name << " (" << out.current_section->name << " is " << out.current_section->size() << " bytes)" << endl;
+            }
+            else if (parse_instruction(ts, inst))
             {
                 cout << "mnemonic: " << inst.menmonic << endl;
 
@@ -42,7 +352,7 @@ int main(int argc, char** argv)
 
                         cout << endl;
                     }
-                    else if (inst.operands[i].type == 2)
+                    else if ((inst.operands[i].type & 0xff) == 2)
                         cout << "reg: " << inst.operands[i].reg << endl;
                     else
                         cout << "operand " << i << ": " << inst.operands[i].type << endl;
@@ -1,25 +1,86 @@
+#include <algorithm>
+#include <cstdio>
+#include <unordered_map>
+#include <elf.h>
+
 #include "output.h"
 
 using namespace std;
 
-Symbol* Output::get_symbol(const string& name)
+Output::Output(const TuningProfile* _tune)
 {
-    for (auto& sym : symbols)
-        if (sym->name == name)
-            return sym;
+    tune = _tune;
+
+    if (tune->jcc_erratum)
+        branch_boundary = 32;
+
+    add_section(".data", { true, true, false, true, 4 });
+    add_section(".bss", { false, true, false, true, 4 });
+    add_section(".rodata", { true, true, false, false, 4 });
+    add_section(".text", { true, true, true, false, (uint64_t)tune->function_align });
+
+    set_current_section(".text");
+}
 
-    return nullptr;
+Symbol* Output::get_symbol(const string& name)
+{
+    return symbol_table.find(name);
 }
 
 Symbol* Output::add_symbol(const string& name)
 {
-    Symbol* sym = new Symbol;
+    Symbol* sym = symbol_arena.alloc();
     sym->name = name;
     symbols.push_back(sym);
+    symbol_table.insert(sym);
 
     return sym;
 }
 
+Symbol* Output::reference_symbol(const string& name)
+{
+    Symbol* sym = get_symbol(name);
+
+    return sym ? sym : add_symbol(name);
+}
+
+// .rodata with -fmerge-constants, any read-only data with -fdedup-literals
+bool collects_items(const Output& out, const Section* sec)
+{
+    if (out.merge_constants && sec->name == ".rodata")
+        return true;
+
+    return out.dedup_literals && sec->attr.progbits && sec->attr.alloc && !sec->attr.write && !sec->attr.exec && !sec->attr.tls;
+}
+
+// remembered for an item that starts right behind the padding
+void remember_align(DataItem& item, Section* sec, uint64_t alignment, uint8_t fill, bool is_fragment)
+{
+    item.aligned = sec;
+    item.align = alignment;
+    item.fill = fill;
+    item.is_fragment = is_fragment;
+    item.start = item.padding = sec->size();
+}
+
+void start_item(DataItem& item, Section* sec, uint64_t offset)
+{
+    // the alignment only counts if nothing came between the align and the item
+    if (item.aligned != sec || item.start != offset)
+    {
+        item.align = 1;
+        item.fill = 0;
+        item.is_fragment = false;
+        item.padding = offset;
+    }
+
+    item.section = sec;
+    item.aligned = nullptr;
+    item.start = offset;
+    item.rels = sec->rels.size();
+    item.fragments = sec->fragments.size();
+}
+
 void Output::define_symbol(const string& name)
 {
     Symbol* sym = get_symbol(name);
@@ -35,9 +96,58 @@ void Output::define_symbol(const string& name)
     else
         sym = add_symbol(name);
 
+    if (item.section && current_section->size() != item.start)
+        end_item();
+
+    // -ffunction-sections, text.name sections let the linker drop unused functions
+    if (function_sections && current_section->attr.exec && (sym->is_exported || sym->type == STT_FUNC))
+    {
+        string section_name = text_section->name + "." + name;
+
+        if (frame.section && frame.is_auto)
+            end_frame();
+
+        current_section = get_section(section_name);
+
+        if (!current_section)
+            current_section = add_section(section_name, text_section->attr);
+    }
+
+    if (function_align && current_section->attr.exec && (sym->is_exported || sym->type == STT_FUNC))
+        align(function_align, function_align - 1, 0);
+
+    if (loop_align && current_section->attr.exec)
+    {
+        Fragment& frag = add_fragment(FRAG_LOOP_ALIGN);
+        frag.alignment = loop_align;
+        frag.max_skip = tune->loop_max_skip;
+    }
+
     sym->is_defined = true;
     sym->section = current_section;
-    sym->offset = current_section->bytes.size();
+    sym->offset = current_section->size();
+    sym->fragment = current_section->fragments.size();
+    sym->is_tls |= current_section->attr.tls;
+
+    current_section->labels.push_back(sym);
+
+    // labels without data between them start the same item
+    if (collects_items(*this, current_section))
+    {
+        if (!item.section)
+            start_item(item, current_section, sym->offset);
+
+        item.labels.push_back(sym);
+    }
+
+    // exported and function labels start a frame, others only when a prologue follows
+    if (auto_cfi && current_section->attr.exec && (!frame.section || frame.is_auto))
+    {
+        frame.label = sym;
+
+        if (sym->is_exported || sym->type == STT_FUNC)
+            start_frame(true, sym->offset, sym->fragment);
+    }
 }
 
 void Output::export_symbol(const string& name)
@@ -75,39 +185,366 @@ void Output::import_symbol(const string& name)
 
 Section* Output::get_section(const string& name)
 {
-    for (auto& sec : sections)
-        if (sec->name == name)
-            return sec;
-
-    return nullptr;
+    return section_table.find(name);
 }
 
 Section* Output::add_section(const string& name, const SectionAttributes& attr)
 {
-    Section* sec = new Section();
+    Section* sec = section_arena.alloc();
     sec->name = name;
     sec->attr = attr;
     sections.push_back(sec);
+    section_table.insert(sec);
 
     return sec;
 }
 
+// N of .rodata.cstN, 0 for other names
+uint64_t constant_section_size(const string& name)
+{
+    const string prefix = ".rodata.cst";
+
+    if (name.rfind(prefix, 0) != 0)
+        return 0;
+
+    size_t end = name.find('.', prefix.size());
+    string digits = name.substr(prefix.size(), end - prefix.size());
+
+    if (digits.empty() || digits.size() > 4 || digits.find_first_not_of("0123456789") != string::npos)
+        return 0;
+
+    uint64_t size = stoull(digits);
+
+    return (size && !(size & (size - 1))) ? size : 0;
+}
+
+// code sections start at the function alignment of the profile, like .text itself
+SectionAttributes default_attributes(const string& name, const TuningProfile* tune)
+{
+    auto is = [&](const string& prefix) { return name == prefix || name.rfind(prefix + ".", 0) == 0; };
+
+    if (is(".text"))
+        return { true, true, true, false, (uint64_t)tune->function_align };
+
+    if (is(".data"))
+        return { true, true, false, true, 4 };
+
+    if (is(".bss"))
+        return { false, true, false, true, 4 };
+
+    if (is(".rodata.str1.1"))
+        return { true, true, false, false, 1, false, false, 1, true };
+
+    uint64_t entsize = constant_section_size(name);
+
+    if (entsize)
+        return { true, true, false, false, entsize, false, false, entsize };
+
+    if (is(".rodata"))
+        return { true, true, false, false, 4 };
+
+    if (is(".ldata"))
+        return { true, true, false, true, 4, false, true };
+
+    if (is(".lbss"))
+        return { false, true, false, true, 4, false, true };
+
+    if (is(".lrodata"))
+        return { true, true, false, false, 4, false, true };
+
+    if (is(".tdata"))
+        return { true, true, false, true, 4, true };
+
+    if (is(".tbss"))
+        return { false, true, false, true, 4, true };
+
+    return { true, true, false, false, 1 };
+}
+
+// .data, .bss and .rodata and their subsections as .ldata, .lbss and .lrodata, other names stay
+string large_section_name(const string& name)
+{
+    for (const string prefix : { ".data", ".bss", ".rodata" })
+        if (name == prefix || name.rfind(prefix + ".", 0) == 0)
+            return ".l" + name.substr(1);
+
+    return name;
+}
+
+// in the large model data sections over the threshold move to the large sections, like -mlarge-data-threshold,
+// the names aren't looked up anymore after layout
+void Output::place_large_data()
+{
+    if (!large_model)
+        return;
+
+    for (auto& sec : sections)
+    {
+        if (sec->attr.large || sec->attr.exec || sec->attr.tls || sec->size() <= large_data_threshold)
+            continue;
+
+        string name = large_section_name(sec->name);
+
+        if (name == sec->name)
+            continue;
+
+        sec->name = name;
+        sec->attr.large = true;
+    }
+}
+
 void Output::set_current_section(const string& name)
 {
+    if (frame.section && frame.is_auto)
+        end_frame();
+
+    end_item();
+
     current_section = get_section(name);
 
     if (!current_section)
-        current_section = add_section(name);
+        current_section = add_section(name, default_attributes(name, tune));
+
+    text_section = current_section;
+}
+
+// a nul terminated string goes to .rodata.str1.1 and a constant of a power of two size from 4 to 32 to .rodata.cstN
+string mergeable_section_name(const vector<uint8_t>& bytes)
+{
+    if (bytes.back() == 0 && find(bytes.begin(), bytes.end() - 1, 0) == bytes.end() - 1)
+        return ".rodata.str1.1";
+
+    for (size_t size = 4; size <= 32; size *= 2)
+        if (bytes.size() == size)
+            return ".rodata.cst" + to_string(size);
+
+    return "";
+}
+
+void Output::end_item()
+{
+    Section* sec = item.section;
+    vector<Symbol*> labels;
+
+    labels.swap(item.labels);
+    item.section = nullptr;
+
+    if (!sec)
+        return;
+
+    uint64_t size = sec->size() - item.start;
+
+    if (!size || sec->rels.size() != item.rels || sec->fragments.size() != item.fragments)
+        return;
+
+    vector<uint8_t> bytes(size);
+    sec->bytes.read(item.start, bytes.data(), size);
+    sec->bytes.truncate(item.padding);
+
+    // the align in front of the item becomes its padding fragment
+    if (item.is_fragment)
+        sec->fragments.pop_back();
+
+    Fragment frag;
+    frag.type = FRAG_LITERAL;
+    frag.offset = item.padding;
+    frag.alignment = item.align;
+    frag.fill = item.fill;
+    frag.is_active = true;
+
+    size_t index = sec->fragments.size();
+    sec->fragments.push_back(frag);
+
+    frag.alignment = 1;
+    frag.length = size;
+    frag.literal = literals.size();
+    sec->fragments.push_back(frag);
+
+    for (auto& sym : labels)
+    {
+        sym->offset = item.padding;
+        sym->fragment = index + 1;
+    }
+
+    literals.push_back({ sec, index, move(bytes), move(labels) });
+}
+
+// before layout, as only then every label difference is known
+void Output::resolve_literals()
+{
+    typedef pair<uint64_t, size_t> Position;
+
+    // dropping an item inside a difference of labels would change it, so those items stay
+    unordered_map<Section*, vector<pair<Position, Position>>> spans;
+
+    auto add_span = [&](const Symbol* a, const Symbol* b)
+    {
+        if (!a->is_defined || !b->is_defined || a->section != b->section)
+            return;
+
+        Position pa = { a->offset, a->fragment };
+        Position pb = { b->offset, b->fragment };
+
+        spans[a->section].push_back(minmax(pa, pb));
+    };
+
+    for (auto& sec : sections)
+        for (auto& rel : sec->rels)
+            if (rel.minus)
+                add_span(rel.sym, rel.minus);
+
+    for (auto& size : sizes)
+        add_span(size.end, size.start);
+
+    // sorted by start, each with the furthest end up to it
+    for (auto& [sec, list] : spans)
+    {
+        sort(list.begin(), list.end());
+
+        for (size_t i = 1; i < list.size(); i++)
+            list[i].second = max(list[i].second, list[i - 1].second);
+    }
+
+    auto is_pinned = [&](const Literal& lit)
+    {
+        for (auto& sym : lit.labels)
+            if (auto_sizes && sym->is_exported && !sym->has_size)
+                return true;
+
+        auto it = spans.find(lit.section);
+
+        if (it == spans.end())
+            return false;
+
+        Position start = { lit.section->fragments[lit.fragment].offset, lit.fragment + 1 };
+        Position end = { start.first, lit.fragment + 2 };
+
+        auto& list = it->second;
+        size_t count = upper_bound(list.begin(), list.end(), make_pair(end, Position(UINT64_MAX, SIZE_MAX))) - list.begin();
+
+        return count && list[count - 1].second >= start;
+    };
+
+    // the copy that later identical items become aliases of, pad is SIZE_MAX in a mergeable section
+    struct Kept
+    {
+        Section* section;
+        uint64_t offset;
+        size_t fragment;
+        size_t pad;
+    };
+
+    unordered_map<string, Kept> kept;
+    vector<Section*> moved;
+
+    auto rebind = [&](Literal& lit, Section* to, uint64_t offset, size_t fragment)
+    {
+        lit.section->fragments[lit.fragment].is_active = false;
+        lit.section->fragments[lit.fragment + 1].is_active = false;
+
+        if (to != lit.section)
+            moved.push_back(lit.section);
+
+        for (auto& sym : lit.labels)
+        {
+            sym->section = to;
+            sym->offset = offset;
+            sym->fragment = fragment;
+
+            if (to != lit.section)
+                to->labels.push_back(sym);
+        }
+    };
+
+    for (auto& lit : literals)
+    {
+        Section* sec = lit.section;
+        Fragment& pad = sec->fragments[lit.fragment];
+        string contents(lit.bytes.begin(), lit.bytes.end());
+        bool pinned = is_pinned(lit);
+
+        if (dedup_literals && !pinned)
+        {
+            auto it = kept.find(contents);
+
+            // a copy in place can take the item's alignment, one in a mergeable section only has its piece size
+            if (it != kept.end() && (it->second.pad != SIZE_MAX || pad.alignment <= it->second.section->attr.align))
+            {
+                Kept& copy = it->second;
+
+                if (copy.pad != SIZE_MAX)
+                {
+                    Fragment& copy_pad = copy.section->fragments[copy.pad];
+                    copy_pad.alignment = max(copy_pad.alignment, pad.alignment);
+                    copy.section->attr.align = max(copy.section->attr.align, pad.alignment);
+                }
+
+                rebind(lit, copy.section, copy.offset, copy.fragment);
+
+                continue;
+            }
+        }
+
+        string name = (merge_constants && sec->name == ".rodata" && !pinned) ? mergeable_section_name(lit.bytes) : "";
+
+        // pieces of a mergeable section are only aligned to their size
+        if (!name.empty() && pad.alignment > default_attributes(name, tune).align)
+            name.clear();
+
+        if (!name.empty())
+        {
+            Section* target = get_section(name);
+
+            if (!target)
+                target = add_section(name, default_attributes(name, tune));
+
+            uint64_t offset = target->size();
+            size_t fragment = target->fragments.size();
+
+            target->bytes.append(lit.bytes.data(), lit.bytes.size());
+            rebind(lit, target, offset, fragment);
+
+            if (!kept.count(contents))
+                kept[contents] = { target, offset, fragment, SIZE_MAX };
+
+            continue;
+        }
+
+        auto it = kept.find(contents);
+
+        if (it == kept.end() || it->second.pad == SIZE_MAX)
+            kept[contents] = { sec, pad.offset, lit.fragment + 1, lit.fragment };
+    }
+
+    for (auto& sec : moved)
+        sec->labels.erase(remove_if(sec->labels.begin(), sec->labels.end(), [&](const Symbol* sym) { return sym->section != sec; }), sec->labels.end());
+}
+
+// the linker keeps one copy of each comdat group, sections with the same signature go together
+void Output::set_group(const string& signature)
+{
+    if (!current_section->group.empty() && current_section->group != signature)
+        throw runtime_error("section '" + current_section->name + "' is already in group '" + current_section->group + "'");
+
+    current_section->group = signature;
+}
+
+ChunkedBytes& Output::data()
+{
+    if (!current_section->attr.progbits)
+        throw runtime_error("can't emit data into nobits section '" + current_section->name + "'");
+
+    return current_section->bytes;
 }
 
 void Output::add(uint8_t byte)
 {
-    current_section->bytes.push_back(byte);
+    data().push_back(byte);
 }
 
 void Output::add(const std::vector<uint8_t>& bytes)
 {
-    current_section->bytes.insert(current_section->bytes.end(), bytes.begin(), bytes.end());
+    data().append(bytes.data(), bytes.size());
 }
 
 void Output::add_imm(uint64_t value, int size)
@@ -117,4 +554,364 @@ void Output::add_imm(uint64_t value, int size)
         add(value & 0xff);
         value >>= 8;
     }
+}
+
+// 1 to 9 bytes are the recommended nop forms, longer ones stack 66 prefixes on the 9 byte form
+const vector<vector<uint8_t>> nops =
+{
+    {},
+    { 0x90 },
+    { 0x66, 0x90 },
+    { 0x0f, 0x1f, 0x00 },
+    { 0x0f, 0x1f, 0x40, 0x00 },
+    { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x66, 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x66, 0x66, 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x66, 0x66, 0x66, 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+void append_nops(ChunkedBytes& bytes, uint64_t count, int max_nop_size)
+{
+    uint64_t max_size = min<uint64_t>(max_nop_size, nops.size() - 1);
+
+    while (count)
+    {
+        uint64_t size = min(count, max_size);
+
+        bytes.append(nops[size].data(), size);
+        count -= size;
+    }
+}
+
+void Output::add_nops(uint64_t count)
+{
+    append_nops(data(), count, tune->max_nop_size);
+}
+
+// zeros in a progbits section, only a bigger size in a nobits one
+void Output::reserve(uint64_t count)
+{
+    if (current_section->attr.progbits)
+        current_section->bytes.append(count, 0);
+    else
+        current_section->reserved += count;
+}
+
+// emits once and copies the result, unless it has fragments that need their own layout per copy
+void Output::repeat(uint64_t count, const function<void()>& emit)
+{
+    if (count <= 1)
+    {
+        if (count)
+            emit();
+
+        return;
+    }
+
+    Section* sec = current_section;
+    uint64_t start = sec->size();
+    size_t first_rel = sec->rels.size();
+    size_t first_frag = sec->fragments.size();
+    size_t frames = sec->frames.size();
+    size_t first_cfi = frames ? sec->frames.back().insns.size() : 0;
+    FrameState state = frame;
+
+    emit();
+
+    // cfi is inferred per instruction, so copies that move the stack or add cfi are encoded one by one too
+    bool changes_frame = sec->frames.size() != frames || (frames && sec->frames.back().insns.size() != first_cfi)
+        || frame.stack_offset != state.stack_offset || frame.cfa_register != state.cfa_register || frame.cfa_offset != state.cfa_offset;
+
+    if (current_section != sec || sec->fragments.size() != first_frag || changes_frame)
+    {
+        for (uint64_t i = 1; i < count; i++)
+            emit();
+
+        return;
+    }
+
+    uint64_t length = sec->size() - start;
+
+    if (length && count - 1 > UINT64_MAX / length)
+        throw runtime_error("times result is too large");
+
+    if (!sec->attr.progbits)
+    {
+        reserve(length * (count - 1));
+        return;
+    }
+
+    size_t last_rel = sec->rels.size();
+
+    for (uint64_t i = 1; i < count && first_rel < last_rel; i++)
+    {
+        for (size_t r = first_rel; r < last_rel; r++)
+        {
+            Relocation rel = sec->rels[r];
+            rel.offset += i * length;
+            sec->rels.push_back(rel);
+        }
+    }
+
+    sec->bytes.repeat(start, count - 1);
+}
+
+void Output::align(uint64_t alignment, uint64_t max_skip, uint8_t fill)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)))
+        throw runtime_error("alignment must be a power of two");
+
+    end_item();
+
+    current_section->attr.align = max(current_section->attr.align, alignment);
+
+    // once there is a fragment the current position is only known after layout
+    if (!current_section->fragments.empty())
+    {
+        Fragment& frag = add_fragment(FRAG_ALIGN);
+        frag.alignment = alignment;
+        frag.max_skip = max_skip;
+        frag.fill = fill;
+
+        if (max_skip >= alignment - 1)
+            remember_align(item, current_section, alignment, fill, true);
+        else
+            item.aligned = nullptr;
+
+        return;
+    }
+
+    uint64_t padding = -current_section->size() & (alignment - 1);
+
+    if (padding > max_skip)
+        return;
+
+    if (current_section->attr.exec)
+        add_nops(padding);
+    else if (!current_section->attr.progbits)
+        reserve(padding);
+    else
+    {
+        uint64_t offset = current_section->size();
+
+        current_section->bytes.append(padding, fill);
+        remember_align(item, current_section, alignment, fill, false);
+        item.padding = offset;
+    }
+}
+
+void Output::add_branch(int cond, const string& target, int64_t addend)
+{
+    Symbol* sym = reference_symbol(target);
+
+    Fragment& frag = add_fragment(FRAG_BRANCH);
+    frag.cond = cond;
+    frag.target = sym;
+    frag.addend = addend;
+}
+
+void Output::add_relocation(const string& name, int type, int64_t addend)
+{
+    Symbol* sym = reference_symbol(name);
+
+    current_section->rels.push_back({ sym, nullptr, current_section->size(), addend, type });
+}
+
+void Output::set_size(const string& name, const string& end, const string& start, int64_t offset)
+{
+    Symbol* sym = reference_symbol(name);
+
+    if (sym->has_size)
+        throw runtime_error("the size of '" + name + "' is already set");
+
+    sym->has_size = true;
+
+    if (end.empty())
+        sym->size = offset;
+    else
+        sizes.push_back({ sym, reference_symbol(end), reference_symbol(start), offset });
+}
+
+// type is the pc relative relocation to use when only minus is in this section
+void Output::add_difference(const string& name, const string& minus, int type, int64_t addend)
+{
+    Symbol* sym = reference_symbol(name);
+    Symbol* sub = reference_symbol(minus);
+
+    current_section->rels.push_back({ sym, nullptr, current_section->size(), addend, type, sub });
+}
+
+void Output::add_line(uint32_t line)
+{
+    if (!debug_lines)
+        return;
+
+    Section* sec = current_section;
+
+    if (!sec->lines.empty() && sec->lines.back().line == line)
+        return;
+
+    sec->lines.push_back({ sec->size(), sec->fragments.size(), line });
+}
+
+void Output::start_frame(bool is_auto, uint64_t offset, size_t fragment)
+{
+    if (frame.section)
+    {
+        if (!frame.is_auto)
+            throw runtime_error("missing .cfi_endproc before .cfi_startproc");
+
+        end_frame();
+    }
+
+    if (!current_section->attr.exec)
+        throw runtime_error("frames can only be in code sections");
+
+    Frame f;
+    f.start = offset;
+    f.start_fragment = fragment;
+
+    current_section->frames.push_back(f);
+
+    frame.section = current_section;
+    frame.is_auto = is_auto;
+    frame.in_prologue = is_auto;
+    frame.cfa_register = frame.body_register = 7;
+    frame.cfa_offset = frame.body_offset = 8;
+    frame.stack_offset = frame.body_stack = 8;
+    frame.restore_pending = false;
+}
+
+void Output::end_frame()
+{
+    if (!frame.section)
+        throw runtime_error(".cfi_endproc without .cfi_startproc");
+
+    Frame& f = frame.section->frames.back();
+    f.end = frame.section->size();
+    f.end_fragment = frame.section->fragments.size();
+
+    // an auto frame that an explicit one replaced right away covers nothing
+    if (f.end == f.start && f.end_fragment == f.start_fragment)
+        frame.section->frames.pop_back();
+
+    frame.section = nullptr;
+    frame.restore_pending = false;
+}
+
+void Output::add_cfi(CfiOp op, int reg, int64_t value)
+{
+    if (!frame.section)
+        throw runtime_error("cfi outside of a frame");
+
+    if (current_section != frame.section)
+        throw runtime_error("cfi in another section than its frame");
+
+    if (op == CFI_DEF_CFA || op == CFI_DEF_CFA_REGISTER)
+        frame.cfa_register = reg;
+
+    if (op == CFI_DEF_CFA || op == CFI_DEF_CFA_OFFSET)
+        frame.cfa_offset = value;
+
+    frame.section->frames.back().insns.push_back({ current_section->size(), current_section->fragments.size(), op, reg, value });
+}
+
+// jumps and the first half of fusible pairs get a boundary fragment so layout can pad in front of them,
+// other instructions can get a prefix fragment so that padding can be absorbed into them instead
+void Output::begin_instruction(int flags)
+{
+    instruction_fragment = current_section->fragments.size();
+
+    // a fusible instruction that ends up without a jcc behind it can still take prefixes
+    if (pad_with_prefixes && (flags & INSN_PREFIXABLE))
+        add_fragment(FRAG_PREFIX);
+
+    if (branch_boundary && (flags & (INSN_JUMP | INSN_FUSIBLE)))
+    {
+        Fragment& frag = add_fragment(FRAG_BOUNDARY);
+        frag.is_fusible = flags & INSN_FUSIBLE;
+    }
+}
+
+void Output::end_instruction()
+{
+    auto& frags = current_section->fragments;
+
+    for (size_t i = instruction_fragment; i < frags.size(); i++)
+    {
+        frags[i].length = current_section->size() - frags[i].offset;
+
+        if (frags[i].type == FRAG_PREFIX)
+            frags[i].max_skip = min<uint64_t>(tune->max_prefixes, 15 - min<uint64_t>(frags[i].length, 15));
+    }
+
+    instruction_fragment = frags.size();
+}
+
+Fragment& Output::add_fragment(FragmentType type)
+{
+    if (!current_section->attr.progbits)
+        throw runtime_error("can't emit code into nobits section '" + current_section->name + "'");
+
+    Fragment frag;
+    frag.type = type;
+    frag.offset = current_section->size();
+
+    current_section->fragments.push_back(frag);
+
+    return current_section->fragments.back();
+}
+
+void hexdump(const ChunkedBytes& bytes)
+{
+    for (size_t i = 0; i < bytes.size(); i += 16)
+    {
+        printf("%08lx:  ", i);
+
+        for (size_t j = i; j < i + 16; j++)
+        {
+            if (j % 16 == 8)
+                printf(" ");
+
+            if (j < bytes.size())
+                printf("%02x ", bytes[j]);
+            else
+                printf("   ");
+        }
+
+        printf(" |");
+
+        for (size_t j = i; j < i + 16 && j < bytes.size(); j++)
+            printf("%c", isprint(bytes[j]) ? bytes[j] : '.');
+
+        printf("|\n");
+    }
+}
+
+void Output::dump()
+{
+    for (auto& sec : sections)
+    {
+        if (!sec->size())
+            continue;
+
+        printf("%s\n", sec->name.c_str());
+
+        if (!sec->attr.progbits)
+            printf("nobits, %lu bytes\n", sec->reserved);
+
+        hexdump(sec->bytes);
+
+        for (auto& rel : sec->rels)
+            printf("  rel %08lx  %s%+ld  type %d\n", rel.offset, rel.sym ? rel.sym->name.c_str() : rel.sec->name.c_str(), rel.addend, rel.type);
+
+        printf("\n");
+    }
 }
\ No newline at end of file
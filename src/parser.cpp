@@ -17,6 +17,139 @@ bool parse_label(TokenStream& ts, string& label)
     return false;
 }
 
+bool parse_times(TokenStream& ts, uint64_t& count)
+{
+    if (!ts.match(REGULAR) || ts[0].str != "times")
+        return false;
+
+    ts.advance();
+
+    Constant c;
+
+    if (!parse_constant_shift(ts, c))
+        throw runtime_error("expected count after times");
+
+    if (c.is_symbolic() || c.offset < 0)
+        throw runtime_error("times count must be a non-negative number");
+
+    count = c.offset;
+
+    return true;
+}
+
+// words after a colon that qualify the argument in front of them
+void parse_qualifiers(TokenStream& ts, Directive& dir)
+{
+    dir.qualifiers.emplace_back();
+
+    if (!ts.match(COLON))
+        return;
+
+    ts.advance();
+
+    if (!ts.match(REGULAR))
+        throw runtime_error("expected qualifier after :");
+
+    while (ts.match(REGULAR))
+    {
+        dir.qualifiers.back().push_back(ts[0].str);
+        ts.advance();
+    }
+}
+
+// bytes of db, dw, dd and dq, 0 for other directives
+int data_unit(const string& name)
+{
+    if (name.size() != 2 || name[0] != 'd')
+        return 0;
+
+    switch (name[1])
+    {
+    case 'b': return 1;
+    case 'w': return 2;
+    case 'd': return 4;
+    case 'q': return 8;
+    default: return 0;
+    }
+}
+
+// a string on its own in a data directive gives its bytes, zero padded to whole units
+bool parse_data_string(TokenStream& ts, Directive& dir)
+{
+    int unit = data_unit(dir.name);
+
+    if (!unit || !ts.match(STRING) || (ts[1].type != COMMA && ts[1].type != EOS))
+        return false;
+
+    const string& str = ts[0].str;
+
+    for (size_t i = 0; i < str.size(); i += unit)
+    {
+        uint64_t value = 0;
+
+        for (int j = unit; j-- > 0;)
+            value = value << 8 | ((i + j < str.size()) ? (uint8_t)str[i + j] : 0);
+
+        Constant arg;
+        arg.offset = value;
+
+        dir.args.push_back(arg);
+        dir.qualifiers.emplace_back();
+    }
+
+    ts.advance();
+
+    return true;
+}
+
+// one argument with its qualifiers, or the units of a string in a data directive
+bool parse_argument(TokenStream& ts, Directive& dir)
+{
+    if (parse_data_string(ts, dir))
+        return true;
+
+    Constant arg;
+
+    if (!parse_constant_shift(ts, arg))
+        return false;
+
+    dir.args.push_back(arg);
+    parse_qualifiers(ts, dir);
+
+    return true;
+}
+
+bool parse_directive(TokenStream& ts, Directive& dir)
+{
+    if (!ts.match(REGULAR) || !is_directive(ts[0].str))
+        return false;
+
+    dir.name = ts[0].str;
+
+    ts.advance();
+
+    if (ts.match(EOS))
+        return true;
+
+    if (!parse_argument(ts, dir))
+        throw runtime_error("expected argument after " + dir.name);
+
+    // type sym function reads like the other assemblers, so its comma is optional
+    while (ts.match(COMMA) || (dir.name == "type" && ts.match(REGULAR)))
+    {
+        if (ts.match(COMMA))
+            ts.advance();
+
+        if (!parse_argument(ts, dir))
+            throw runtime_error("expected argument after comma");
+    }
+
+    if (!ts.match(EOS))
+        throw runtime_error("junk after " + dir.name);
+
+    return true;
+}
+
 bool parse_instruction(TokenStream& ts, Instruction& inst)
 {
     if (!ts.match(REGULAR))
@@ -54,6 +187,8 @@ bool parse_instruction(TokenStream& ts, Instruction& inst)
 
 bool parse_operand(TokenStream& ts, Operand& op)
 {
+    op = Operand();
+
     return parse_register(ts, op) || parse_memory(ts, op) || parse_immediate(ts, op);
 }
 
@@ -71,6 +206,29 @@ unordered_map<string, int> register_map =
     {"r8b", 8}, {"r9b", 9}, {"r10b", 10}, {"r11b", 11}, {"r12b", 12}, {"r13b", 13}, {"r14b", 14}, {"r15b", 15},
 };
 
+int register_size(const string& name)
+{
+    if (name[0] == 'r')
+    {
+        switch (name.back())
+        {
+        case 'd': return 4;
+        case 'w': return 2;
+        case 'b': return 1;
+        default: return 8;
+        }
+    }
+
+    if (name[0] == 'e')
+        return 4;
+
+    // spl, bpl, sil, dil and the al .. bh registers
+    if (name.size() == 3 || name.back() == 'l' || name.back() == 'h')
+        return 1;
+
+    return 2;
+}
+
 bool parse_register(TokenStream& ts, Operand& op)
 {
     if (!ts.match(REGULAR))
@@ -81,7 +239,7 @@ bool parse_register(TokenStream& ts, Operand& op)
     if (it == register_map.end())
         return false;
 
-    op.type = 2;
+    op.type = 2 | register_size(ts[0].str) << 8;
     op.reg = it->second;
 
     ts.advance();
@@ -126,69 +284,280 @@ bool parse_memory_prefix(TokenStream& ts, int& size)
     return true;
 }
 
-bool parse_memory(TokenStream& ts, Operand& op)
+// wrt ..name or a sym@name suffix picks the kind of relocation
+bool parse_wrt(TokenStream& ts, Operand& op)
 {
-    int size = 0;
-    bool has_size = parse_memory_prefix(ts, size);
+    size_t at = op.symbol.find('@');
 
-    if (!ts.match(OPEN_BRACKET))
+    if (at != string::npos)
     {
-        if (has_size)
-            throw runtime_error("expected [ after memory prefix");
+        op.wrt = ".." + op.symbol.substr(at + 1);
+        op.symbol.resize(at);
+    }
+
+    if (!ts.match(REGULAR) || ts[0].str != "wrt")
+        return !op.wrt.empty();
+
+    if (!op.wrt.empty())
+        throw runtime_error("wrt after @ suffix");
+
+    ts.advance();
 
+    if (!ts.match(REGULAR) || ts[0].str.rfind("..", 0) != 0)
+        throw runtime_error("expected ..name after wrt");
+
+    op.wrt = ts[0].str;
+    ts.advance();
+
+    return true;
+}
+
+unordered_map<string, uint8_t> segment_prefixes =
+{
+    {"es", 0x26}, {"cs", 0x2e}, {"ss", 0x36}, {"ds", 0x3e}, {"fs", 0x64}, {"gs", 0x65},
+};
+
+bool parse_segment(TokenStream& ts, Operand& op)
+{
+    if (!ts.match({ REGULAR, COLON }))
         return false;
+
+    auto it = segment_prefixes.find(ts[0].str);
+
+    if (it == segment_prefixes.end())
+        return false;
+
+    op.segment = it->second;
+    ts.advance(2);
+
+    return true;
+}
+
+uint64_t prefix_stoull(const string& str)
+{
+    if (str.size() > 2 && str[0] == '0' && (str[1] == 'b' || str[1] == 'x'))
+    {
+        int base = (str[1] == 'b') ? 2 : 16;
+
+        return stoull(str.substr(2), nullptr, base);
     }
 
+    return stoull(str);
+}
+
+// reg, reg * scale or scale * reg
+bool parse_address_register(TokenStream& ts, int& reg, int& size, int& scale)
+{
     size_t i = 0;
+    scale = 1;
+
+    if (ts.match({ NUMERIC, TIMES, REGULAR }))
+        i = 2;
+
+    if (ts[i].type != REGULAR)
+        return false;
+
+    auto it = register_map.find(ts[i].str);
+
+    if (it == register_map.end())
+        return false;
+
+    reg = it->second;
+    size = register_size(ts[i].str);
+
+    if (i)
+        scale = prefix_stoull(ts[0].str);
+
+    ts.advance(i + 1);
+
+    if (!i && ts.match({ TIMES, NUMERIC }))
+    {
+        scale = prefix_stoull(ts[1].str);
+        ts.advance(2);
+    }
+
+    return true;
+}
+
+void add_address_register(Operand& op, int reg, int size, int scale)
+{
+    if (size != 8 && size != 4)
+        throw runtime_error("address registers must be 32 or 64 bit");
+
+    if ((op.base >= 0 || op.index >= 0) && op.address_override != (size == 4))
+        throw runtime_error("address registers must have the same size");
+
+    op.address_override = (size == 4);
+
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+        throw runtime_error("scale must be 1, 2, 4 or 8");
 
-    while (ts[i].type != EOS)
+    if (scale == 1 && op.base < 0)
+        op.base = reg;
+    else if (op.index < 0)
     {
-        if (ts[i].type == CLOSE_BRACKET)
+        op.index = reg;
+        op.scale = scale;
+    }
+    else
+        throw runtime_error("too many registers in address");
+}
+
+// rel? term (+|- term)*, terms are registers, scaled registers and constants
+void parse_address(TokenStream& ts, Operand& op)
+{
+    op.base = -1;
+    op.index = -1;
+    op.scale = 1;
+
+    if (ts.match(REGULAR) && ts[0].str == "rel")
+    {
+        op.is_relative = true;
+        ts.advance();
+    }
+
+    Constant c;
+    bool first = true;
+
+    while (first || ts.match_any({ PLUS, MINUS }))
+    {
+        bool negative = false;
+
+        if (!first)
+        {
+            negative = ts.match(MINUS);
+            ts.advance();
+        }
+
+        first = false;
+
+        int reg, size, scale;
+
+        if (ts.match(REGULAR) && ts[0].str == "rip")
         {
-            op.type = 3;
+            if (negative || op.is_relative)
+                throw runtime_error("unexpected rip in address");
+
+            op.is_relative = true;
+            ts.advance();
+
+            continue;
+        }
 
-            if (has_size)
-                op.type |= size << 8;
+        if (parse_address_register(ts, reg, size, scale))
+        {
+            if (negative)
+                throw runtime_error("registers can't be subtracted in an address");
 
-            ts.advance(i + 1);
+            add_address_register(op, reg, size, scale);
 
-            return true;
+            continue;
         }
 
-        i++;
+        Constant term;
+
+        if (!parse_constant_unary(ts, term))
+            throw runtime_error("expected register or constant in address");
+
+        c = negative ? c - term : c + term;
     }
 
-    throw runtime_error("expected ] after effective address");
+    if (op.is_relative && (op.base >= 0 || op.index >= 0))
+        throw runtime_error("rip relative addresses can't have other registers");
+
+    // only the base can encode rsp and r12 is fine as an index
+    if (op.index == 4 && op.scale == 1)
+        swap(op.base, op.index);
+
+    if (op.index == 4)
+        throw runtime_error("rsp can't be an index register");
+
+    if (c.is_difference())
+        throw runtime_error("symbol differences are only supported in data directives");
+
+    if (c.offset < INT32_MIN || c.offset > INT32_MAX)
+        throw runtime_error("displacement doesn't fit in 32 bits");
+
+    op.disp = c.offset;
+    op.symbol = c.symbol;
+}
+
+// size? segment:? [segment:? address (wrt ..name)?]
+bool parse_memory(TokenStream& ts, Operand& op)
+{
+    int size = 0;
+    bool has_size = parse_memory_prefix(ts, size);
+    bool has_segment = parse_segment(ts, op);
+
+    if (!ts.match(OPEN_BRACKET))
+    {
+        if (has_size || has_segment)
+            throw runtime_error("expected [ after memory prefix");
+
+        return false;
+    }
+
+    ts.advance();
+
+    if (!has_segment)
+        parse_segment(ts, op);
+
+    parse_address(ts, op);
+    parse_wrt(ts, op);
+
+    if (!ts.match(CLOSE_BRACKET))
+        throw runtime_error("expected ] after effective address");
+
+    ts.advance();
+
+    op.type = 3;
+
+    if (has_size)
+        op.type |= size << 8;
+
+    return true;
 }
 
 bool parse_immediate(TokenStream& ts, Operand& op)
 {
     Constant constant;
 
-    if (!parse_constant_sum(ts, constant))
+    if (!parse_constant_shift(ts, constant))
         return false;
 
+    if (constant.is_difference())
+        throw runtime_error("symbol differences are only supported in data directives");
+
     op.type = 1;
     op.imm = constant.offset;
     op.symbol = constant.symbol;
 
+    parse_wrt(ts, op);
+
     return true;
 }
 
-uint64_t prefix_stoull(const string& str)
+bool parse_constant_atom(TokenStream& ts, Constant& c)
 {
-    if (str.size() > 2 && str[0] == '0' && (str[1] == 'b' || str[1] == 'x'))
+    // a character constant, the first character is the lowest byte
+    if (ts.match(STRING))
     {
-        int base = (str[1] == 'b') ? 2 : 16;
+        const string& str = ts[0].str;
 
-        return stoull(str.substr(2), nullptr, base);
-    }
+        if (str.size() > 8)
+            throw runtime_error("character constant '" + str + "' is longer than 8 bytes");
 
-    return stoull(str);
-}
+        uint64_t value = 0;
+
+        for (size_t i = str.size(); i-- > 0;)
+            value = value << 8 | (uint8_t)str[i];
+
+        c.offset = value;
+        ts.advance();
+
+        return true;
+    }
 
-bool parse_constant_atom(TokenStream& ts, Constant& c)
-{
     if (ts.match(NUMERIC))
     {
         c.offset = prefix_stoull(ts[0].str);
@@ -251,5 +620,39 @@ bool parse_constant_sum(TokenStream& ts, Constant& c)
         c = (op == PLUS) ? c + rhs : c - rhs;
     }
 
+    return true;
+}
+
+// << and >> bind looser than + and -, both sides must be plain numbers and >> shifts in zeros
+bool parse_constant_shift(TokenStream& ts, Constant& c)
+{
+    if (!parse_constant_sum(ts, c))
+        return false;
+
+    while (ts.match_any({ SHIFT_LEFT, SHIFT_RIGHT }))
+    {
+        TokenType op = ts[0].type;
+
+        ts.advance();
+
+        Constant rhs;
+
+        if (!parse_constant_sum(ts, rhs))
+            throw runtime_error("expected constant expression after " + string((op == SHIFT_LEFT) ? "<<" : ">>"));
+
+        if (c.is_symbolic() || rhs.is_symbolic())
+            throw runtime_error("only numbers can be shifted");
+
+        if (rhs.offset < 0)
+            throw runtime_error("shift count can't be negative");
+
+        uint64_t value = c.offset;
+
+        if (rhs.offset >= 64)
+            c.offset = 0;
+        else
+            c.offset = (op == SHIFT_LEFT) ? value << rhs.offset : value >> rhs.offset;
+    }
+
     return true;
 }
\ No newline at end of file
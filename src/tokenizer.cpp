@@ -1,3 +1,6 @@
+#include <cctype>
+#include <stdexcept>
+
 #include "tokenizer.h"
 
 using namespace std;
@@ -16,20 +19,34 @@ void replace_substring(string& str, const string& old, const string& rep)
     }
 }
 
+// a ; inside a string doesn't start a comment
 void remove_comment(string& line)
 {
-    size_t pos = line.find(";");
+    char quote = 0;
 
-    if (pos != string::npos)
-        line = line.substr(0, pos);
+    for (size_t i = 0; i < line.size(); i++)
+    {
+        if (quote)
+        {
+            if (quote == '`' && line[i] == '\\')
+                i++;
+            else if (line[i] == quote)
+                quote = 0;
+        }
+        else if (line[i] == '"' || line[i] == '\'' || line[i] == '`')
+            quote = line[i];
+        else if (line[i] == ';')
+        {
+            line.resize(i);
+            return;
+        }
+    }
 }
 
 string clean_line(const string& line)
 {
     string ret = line;
 
-    remove_comment(ret);
-
     replace_substring(ret, ":", " : ");
     replace_substring(ret, ",", " , ");
     replace_substring(ret, "[", " [ ");
@@ -37,6 +54,8 @@ string clean_line(const string& line)
     replace_substring(ret, "+", " + ");
     replace_substring(ret, "-", " - ");
     replace_substring(ret, "*", " * ");
+    replace_substring(ret, "<<", " << ");
+    replace_substring(ret, ">>", " >> ");
 
     return ret;
 }
@@ -82,7 +101,78 @@ const Token TokenStream::eos = { EOS, "" };
 
 TokenStream::TokenStream(const std::string& line)
 {
-    string cleaned = clean_line(line);
+    string text = line;
+    remove_comment(text);
+
+    size_t pos = 0;
+
+    // strings are kept whole, only the text between them is split up
+    while (pos < text.size())
+    {
+        size_t quote = text.find_first_of("\"'`", pos);
+
+        split(text.substr(pos, quote - pos));
+
+        if (quote == string::npos)
+            break;
+
+        pos = add_string(text, quote);
+    }
+}
+
+// "..." and '...' are taken as they are, `...` understands c style escapes
+size_t TokenStream::add_string(const string& text, size_t quote)
+{
+    char delim = text[quote];
+    string str;
+    size_t i = quote + 1;
+
+    for (; i < text.size() && text[i] != delim; i++)
+    {
+        if (delim != '`' || text[i] != '\\' || i + 1 == text.size())
+        {
+            str += text[i];
+            continue;
+        }
+
+        switch (text[++i])
+        {
+        case 'n': str += '\n'; break;
+        case 't': str += '\t'; break;
+        case 'r': str += '\r'; break;
+        case '0': str += '\0'; break;
+        case 'x':
+        {
+            int value = 0;
+            int n = 0;
+
+            for (; n < 2 && i + 1 < text.size() && isxdigit(text[i + 1]); n++)
+            {
+                char c = tolower(text[++i]);
+                value = value * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+            }
+
+            if (!n)
+                throw runtime_error("expected hex digits after \\x");
+
+            str += (char)value;
+            break;
+        }
+        default: str += text[i]; break;
+        }
+    }
+
+    if (i == text.size())
+        throw runtime_error("missing closing " + string(1, delim));
+
+    tokens.push_back({ STRING, str });
+
+    return i + 1;
+}
+
+void TokenStream::split(const string& text)
+{
+    string cleaned = clean_line(text);
 
     istringstream iss(cleaned);
     string str;
@@ -107,6 +197,10 @@ TokenStream::TokenStream(const std::string& line)
             type = MINUS;
         else if (str == "*")
             type = TIMES;
+        else if (str == "<<")
+            type = SHIFT_LEFT;
+        else if (str == ">>")
+            type = SHIFT_RIGHT;
 
         tokens.push_back({ type, str });
     }
@@ -0,0 +1,23 @@
+#include "tuning.h"
+
+using namespace std;
+
+std::vector<TuningProfile> tuning_profiles =
+{
+    //  name                nop     pfx     func    loop    skip    jcc
+    {   "generic",          11,     3,      16,     16,     10,     false   },
+    {   "skylake",          15,     5,      16,     32,     15,     true    },
+    {   "icelake",          15,     5,      16,     32,     15,     false   },
+    {   "znver3",           11,     3,      32,     32,     15,     false   },
+    {   "znver4",           11,     3,      32,     32,     15,     false   },
+    {   "sapphirerapids",   15,     5,      16,     32,     15,     false   },
+};
+
+const TuningProfile* get_tuning_profile(const string& name)
+{
+    for (auto& profile : tuning_profiles)
+        if (profile.name == name)
+            return &profile;
+
+    return nullptr;
+}
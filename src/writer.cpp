@@ -0,0 +1,636 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+using namespace std;
+
+const uint8_t zeros[4096] = {};
+
+// from the x86-64 psabi, missing in older elf.h
+const uint64_t SHF_X86_64_LARGE = 0x10000000;
+
+// large views are split so threads get pieces of similar size
+const size_t max_piece = 1 << 20;
+
+// runs fn(0) .. fn(count - 1) on up to threads threads, the calling one included
+void parallel_for(unsigned threads, size_t count, const function<void(size_t)>& fn)
+{
+    atomic<size_t> next(0);
+
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < count; i = next++)
+            fn(i);
+    };
+
+    vector<thread> pool;
+
+    for (unsigned i = 1; i < threads && i < count; i++)
+        pool.emplace_back(worker);
+
+    worker();
+
+    for (auto& t : pool)
+        t.join();
+}
+
+uint32_t StringTable::add(const string& str)
+{
+    // id 0 is the empty string
+    if (str.empty())
+        return 0;
+
+    auto it = ids.find(str);
+
+    if (it != ids.end())
+        return it->second;
+
+    uint32_t id = strings.size() + 1;
+
+    strings.push_back(str);
+    ids.emplace(strings.back(), id);
+
+    return id;
+}
+
+// true if a sorts before b when both are read backwards, so a string comes right after the longer ones ending with it
+bool tail_order(string_view a, string_view b)
+{
+    auto ra = a.rbegin();
+    auto rb = b.rbegin();
+
+    for (; ra != a.rend() && rb != b.rend(); ra++, rb++)
+        if (*ra != *rb)
+            return *ra > *rb;
+
+    return a.size() > b.size();
+}
+
+void StringTable::finalize()
+{
+    vector<uint32_t> order(strings.size());
+
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return tail_order(strings[a], strings[b]); });
+
+    offsets.assign(strings.size() + 1, 0);
+
+    string_view prev;
+    uint32_t prev_offset = 0;
+
+    for (auto id : order)
+    {
+        string_view str = strings[id];
+
+        if (prev.size() >= str.size() && prev.substr(prev.size() - str.size()) == str)
+        {
+            offsets[id + 1] = prev_offset + prev.size() - str.size();
+            continue;
+        }
+
+        offsets[id + 1] = bytes.size();
+        bytes.insert(bytes.end(), str.begin(), str.end());
+        bytes.push_back(0);
+
+        prev = str;
+        prev_offset = offsets[id + 1];
+    }
+}
+
+uint32_t StringTable::offset(uint32_t id) const
+{
+    return offsets[id];
+}
+
+ElfWriter::ElfWriter(Output& _out, const string& _source_name, unsigned _threads) : out(_out), source_name(_source_name), threads(_threads)
+{
+}
+
+void ElfWriter::build()
+{
+    for (auto& sym : out.symbols)
+        if (!sym->is_defined && !sym->is_imported)
+            throw runtime_error("symbol '" + sym->name + "' is undefined");
+
+    build_sections();
+    build_symbols();
+    build_relocations();
+    build_layout();
+}
+
+size_t ElfWriter::add_shdr(const string& name, uint32_t type, uint64_t flags, uint64_t align, uint64_t entsize)
+{
+    Elf64_Shdr shdr = {};
+    shdr.sh_name = shstrtab.add(name);
+    shdr.sh_type = type;
+    shdr.sh_flags = flags;
+    shdr.sh_addralign = align;
+    shdr.sh_entsize = entsize;
+
+    shdrs.push_back(shdr);
+
+    return shdrs.size() - 1;
+}
+
+void ElfWriter::build_sections()
+{
+    shdrs.push_back({});
+
+    // empty sections are left out unless a symbol is defined in them
+    for (auto& sec : out.sections)
+        sec->index = 0;
+
+    for (auto& sym : out.symbols)
+        if (sym->is_defined)
+            sym->section->index = 1;
+
+    for (auto& sec : out.sections)
+        if (sec->size() || sec->index)
+            sections.push_back(sec);
+
+    // a group section has to come before its members
+    for (auto& sec : sections)
+    {
+        if (sec->group.empty() || group_ids.count(sec->group))
+            continue;
+
+        group_ids[sec->group] = groups.size();
+        groups.push_back({ sec->group, add_shdr(".group", SHT_GROUP, 0, 4, sizeof(uint32_t)), { GRP_COMDAT } });
+    }
+
+    for (auto& sec : sections)
+    {
+        uint64_t flags = 0;
+
+        if (sec->attr.alloc)
+            flags |= SHF_ALLOC;
+
+        if (sec->attr.exec)
+            flags |= SHF_EXECINSTR;
+
+        if (sec->attr.write)
+            flags |= SHF_WRITE;
+
+        if (sec->attr.tls)
+            flags |= SHF_TLS;
+
+        if (sec->attr.large)
+            flags |= SHF_X86_64_LARGE;
+
+        if (!sec->group.empty())
+            flags |= SHF_GROUP;
+
+        if (sec->attr.entsize)
+            flags |= SHF_MERGE;
+
+        if (sec->attr.strings)
+            flags |= SHF_STRINGS;
+
+        sec->index = add_shdr(sec->name, sec->attr.progbits ? SHT_PROGBITS : SHT_NOBITS, flags, sec->attr.align, sec->attr.entsize);
+        shdrs.back().sh_size = sec->size();
+
+        if (!sec->group.empty())
+            groups[group_ids[sec->group]].words.push_back(sec->index);
+    }
+
+    shstrtab_index = add_shdr(".shstrtab", SHT_STRTAB, 0, 1);
+    symtab_index = add_shdr(".symtab", SHT_SYMTAB, 0, 8, sizeof(Elf64_Sym));
+    strtab_index = add_shdr(".strtab", SHT_STRTAB, 0, 1);
+
+    shdrs[symtab_index].sh_link = strtab_index;
+
+    for (auto& group : groups)
+        shdrs[group.index].sh_link = symtab_index;
+
+    // section indices from SHN_LORESERVE up don't fit in st_shndx, the symbols get them from .symtab_shndx
+    if (groups.size() + sections.size() + 1 >= SHN_LORESERVE)
+    {
+        symtab_shndx_index = add_shdr(".symtab_shndx", SHT_SYMTAB_SHNDX, 0, 4, sizeof(uint32_t));
+        shdrs[symtab_shndx_index].sh_link = symtab_index;
+    }
+}
+
+void ElfWriter::add_symbol(Elf64_Sym sym, uint32_t section)
+{
+    sym.st_shndx = (section >= SHN_LORESERVE && section != SHN_ABS) ? SHN_XINDEX : section;
+
+    syms.push_back(sym);
+    shndx.push_back((sym.st_shndx == SHN_XINDEX) ? section : 0);
+}
+
+void ElfWriter::build_symbols()
+{
+    add_symbol({}, SHN_UNDEF);
+
+    Elf64_Sym file_sym = {};
+    file_sym.st_name = strtab.add(source_name);
+    file_sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_FILE);
+
+    add_symbol(file_sym, SHN_ABS);
+
+    for (auto& sec : sections)
+    {
+        Elf64_Sym sym = {};
+        sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+
+        sec->symbol = syms.size();
+        add_symbol(sym, sec->index);
+    }
+
+    // a signature that names no symbol gets a local one defined in its group section
+    for (auto& group : groups)
+    {
+        if (out.get_symbol(group.signature))
+            continue;
+
+        Elf64_Sym sym = {};
+        sym.st_name = strtab.add(group.signature);
+        sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE);
+
+        shdrs[group.index].sh_info = syms.size();
+        add_symbol(sym, group.index);
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool global = pass;
+
+        if (global)
+            shdrs[symtab_index].sh_info = syms.size();
+
+        for (auto& _sym : out.symbols)
+        {
+            if ((_sym->is_exported || _sym->is_imported) != global)
+                continue;
+
+            Elf64_Sym sym = {};
+            sym.st_name = strtab.add(_sym->name);
+            sym.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, _sym->is_tls ? STT_TLS : _sym->type);
+            sym.st_other = _sym->visibility;
+            sym.st_value = _sym->is_defined ? _sym->offset : 0;
+            sym.st_size = _sym->size;
+
+            _sym->index = syms.size();
+            add_symbol(sym, _sym->is_defined ? _sym->section->index : SHN_UNDEF);
+        }
+    }
+
+    for (auto& group : groups)
+        if (Symbol* sym = out.get_symbol(group.signature))
+            shdrs[group.index].sh_info = sym->index;
+}
+
+// the linker makes a got entry for the symbol itself, with a section symbol it would be for the section start
+bool is_got_relocation(int type)
+{
+    switch (type)
+    {
+    case R_X86_64_GOT32:
+    case R_X86_64_GOTPCREL:
+    case R_X86_64_GOT64:
+    case R_X86_64_GOTPCREL64:
+    case R_X86_64_GOTPLT64:
+    case R_X86_64_GOTPCRELX:
+    case R_X86_64_REX_GOTPCRELX:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void ElfWriter::build_relocations()
+{
+    vector<Section*> targets;
+
+    for (auto& sec : sections)
+    {
+        if (sec->rels.empty())
+            continue;
+
+        size_t index = add_shdr(".rela" + sec->name, SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela));
+        shdrs[index].sh_link = symtab_index;
+        shdrs[index].sh_info = sec->index;
+        shdrs[index].sh_size = sec->rels.size() * sizeof(Elf64_Rela);
+
+        // relocations of a member go away with it, so they are in the group as well
+        if (!sec->group.empty())
+        {
+            shdrs[index].sh_flags |= SHF_GROUP;
+            groups[group_ids[sec->group]].words.push_back(index);
+        }
+
+        targets.push_back(sec);
+    }
+
+    relas.resize(targets.size());
+
+    // symbol and section indices are final here, so every table can be filled on its own
+    parallel_for(threads, targets.size(), [&](size_t i)
+    {
+        vector<Elf64_Rela>& rels = relas[i];
+        rels.resize(targets[i]->rels.size());
+
+        for (size_t j = 0; j < rels.size(); j++)
+        {
+            const Relocation& rel = targets[i]->rels[j];
+            Elf64_Rela& rela = rels[j];
+
+            rela.r_offset = rel.offset;
+            rela.r_addend = rel.addend;
+
+            uint32_t index;
+
+            // local symbols are referenced through their section symbol, except by tls and got relocations
+            // since those need the symbol itself, and in mergeable sections since the linker finds the
+            // piece by symbol value plus addend and pc relative addends point in front of it
+            if (rel.sym && (rel.sym->is_exported || rel.sym->is_imported || rel.sym->is_tls || is_got_relocation(rel.type) || rel.sym->section->attr.entsize))
+                index = rel.sym->index;
+            else if (rel.sym)
+            {
+                index = rel.sym->section->symbol;
+                rela.r_addend += rel.sym->offset;
+            }
+            else
+                index = rel.sec->symbol;
+
+            rela.r_info = ELF64_R_INFO(index, rel.type);
+        }
+    });
+}
+
+void ElfWriter::build_layout()
+{
+    // names hold string table ids until the tables are laid out
+    shstrtab.finalize();
+    strtab.finalize();
+
+    for (auto& shdr : shdrs)
+        shdr.sh_name = shstrtab.offset(shdr.sh_name);
+
+    for (auto& sym : syms)
+        sym.st_name = strtab.offset(sym.st_name);
+
+    shdrs[shstrtab_index].sh_size = shstrtab.bytes.size();
+    shdrs[symtab_index].sh_size = syms.size() * sizeof(Elf64_Sym);
+    shdrs[strtab_index].sh_size = strtab.bytes.size();
+
+    for (auto& group : groups)
+        shdrs[group.index].sh_size = group.words.size() * sizeof(uint32_t);
+
+    if (symtab_shndx_index)
+        shdrs[symtab_shndx_index].sh_size = shndx.size() * sizeof(uint32_t);
+
+    ehdr = {};
+    ehdr.e_ident[EI_MAG0] = ELFMAG0;
+    ehdr.e_ident[EI_MAG1] = ELFMAG1;
+    ehdr.e_ident[EI_MAG2] = ELFMAG2;
+    ehdr.e_ident[EI_MAG3] = ELFMAG3;
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = shdrs.size();
+    ehdr.e_shstrndx = shstrtab_index;
+
+    // with too many sections the real count and string table index live in the null section header
+    if (shdrs.size() >= SHN_LORESERVE)
+    {
+        ehdr.e_shnum = 0;
+        shdrs[0].sh_size = shdrs.size();
+    }
+
+    if (shstrtab_index >= SHN_LORESERVE)
+    {
+        ehdr.e_shstrndx = SHN_XINDEX;
+        shdrs[0].sh_link = shstrtab_index;
+    }
+
+    uint64_t offset = ehdr.e_shoff + shdrs.size() * sizeof(Elf64_Shdr);
+
+    for (size_t i = 1; i < shdrs.size(); i++)
+    {
+        uint64_t align = max<uint64_t>(shdrs[i].sh_addralign, 1);
+
+        offset = (offset + align - 1) & ~(align - 1);
+        shdrs[i].sh_offset = offset;
+
+        if (shdrs[i].sh_type != SHT_NOBITS)
+            offset += shdrs[i].sh_size;
+    }
+
+    file_size = offset;
+}
+
+vector<FileView> ElfWriter::views() const
+{
+    vector<FileView> views;
+    uint64_t pos = 0;
+
+    auto add = [&](const void* data, size_t size)
+    {
+        views.push_back({ data, size });
+        pos += size;
+    };
+
+    add(&ehdr, sizeof(ehdr));
+    add(shdrs.data(), shdrs.size() * sizeof(Elf64_Shdr));
+
+    size_t rela = 0;
+
+    for (size_t i = 1; i < shdrs.size(); i++)
+    {
+        const Elf64_Shdr& shdr = shdrs[i];
+
+        if (shdr.sh_type == SHT_NOBITS || !shdr.sh_size)
+            continue;
+
+        while (pos < shdr.sh_offset)
+            add(zeros, min<uint64_t>(shdr.sh_offset - pos, sizeof(zeros)));
+
+        if (i <= groups.size())
+            add(groups[i - 1].words.data(), shdr.sh_size);
+        else if (i <= groups.size() + sections.size())
+        {
+            const ChunkedBytes& bytes = sections[i - groups.size() - 1]->bytes;
+
+            for (size_t c = 0; c < bytes.chunk_count(); c++)
+                add(bytes.chunk_data(c), bytes.chunk_size(c));
+        }
+        else if (i == shstrtab_index)
+            add(shstrtab.bytes.data(), shstrtab.bytes.size());
+        else if (i == symtab_index)
+            add(syms.data(), shdr.sh_size);
+        else if (i == strtab_index)
+            add(strtab.bytes.data(), strtab.bytes.size());
+        else if (i == symtab_shndx_index)
+            add(shndx.data(), shdr.sh_size);
+        else
+        {
+            add(relas[rela].data(), shdr.sh_size);
+            rela++;
+        }
+    }
+
+    return views;
+}
+
+void ElfWriter::write(const string& path) const
+{
+    vector<FileView> file = views();
+    vector<iovec> iov(file.size());
+
+    for (size_t i = 0; i < file.size(); i++)
+        iov[i] = { (void*)file[i].data, file[i].size };
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        throw runtime_error("could not open '" + path + "' for writing");
+
+    size_t i = 0;
+
+    while (i < iov.size())
+    {
+        ssize_t written = writev(fd, &iov[i], min<size_t>(iov.size() - i, IOV_MAX));
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            close(fd);
+            throw runtime_error("could not write '" + path + "'");
+        }
+
+        // skip what was written, a partial write leaves the rest of a view for the next call
+        for (; i < iov.size() && (size_t)written >= iov[i].iov_len; i++)
+            written -= iov[i].iov_len;
+
+        if (written)
+        {
+            iov[i].iov_base = (uint8_t*)iov[i].iov_base + written;
+            iov[i].iov_len -= written;
+        }
+    }
+
+    close(fd);
+}
+
+// creates the file at its final size, the parts that are never written read back as zeros
+int ElfWriter::create(const string& path) const
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        throw runtime_error("could not open '" + path + "' for writing");
+
+    if (ftruncate(fd, file_size) < 0)
+    {
+        close(fd);
+        throw runtime_error("could not resize '" + path + "'");
+    }
+
+    // only a hint, filesystems without support still work
+    fallocate(fd, 0, 0, file_size);
+
+    return fd;
+}
+
+bool ElfWriter::copy_views(const function<bool(uint64_t, const FileView&)>& copy) const
+{
+    vector<FileView> file = views();
+    vector<pair<uint64_t, FileView>> pieces;
+    uint64_t offset = 0;
+
+    for (auto& view : file)
+    {
+        if (view.data != zeros)
+        {
+            for (size_t done = 0; done < view.size; done += max_piece)
+                pieces.push_back({ offset + done, { (const uint8_t*)view.data + done, min(view.size - done, max_piece) } });
+        }
+
+        offset += view.size;
+    }
+
+    atomic<bool> failed(false);
+
+    parallel_for(threads, pieces.size(), [&](size_t i)
+    {
+        if (!failed && !copy(pieces[i].first, pieces[i].second))
+            failed = true;
+    });
+
+    return !failed;
+}
+
+void ElfWriter::write_mapped(const string& path) const
+{
+    int fd = create(path);
+    uint8_t* map = (uint8_t*)mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        throw runtime_error("could not map '" + path + "'");
+    }
+
+    copy_views([&](uint64_t offset, const FileView& view)
+    {
+        memcpy(map + offset, view.data, view.size);
+        return true;
+    });
+
+    munmap(map, file_size);
+    close(fd);
+}
+
+void ElfWriter::write_positioned(const string& path) const
+{
+    int fd = create(path);
+
+    bool ok = copy_views([&](uint64_t offset, const FileView& view)
+    {
+        const uint8_t* data = (const uint8_t*)view.data;
+        size_t left = view.size;
+
+        while (left)
+        {
+            ssize_t written = pwrite(fd, data, left, offset);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                return false;
+
+            data += written;
+            offset += written;
+            left -= written;
+        }
+
+        return true;
+    });
+
+    close(fd);
+
+    if (!ok)
+        throw runtime_error("could not write '" + path + "'");
+}
@@ -0,0 +1,20 @@
+; times repeats a push or pop for the unwind info too, and code after a ret that isn't the last
+; instruction is back in the body state, test_cfi.sh checks the cfa rows of both functions
+
+global f
+global g
+
+section .text
+f:
+        times 2 push rbx
+        mov     eax, 0
+        times 2 pop rbx
+        ret
+g:
+        push    rbx
+        mov     eax, 0
+        pop     rbx
+        ret
+        mov     eax, 1
+        pop     rbx
+        ret
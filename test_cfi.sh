@@ -0,0 +1,27 @@
+#!/bin/sh
+# assembles test_cfi.asm with -fauto-cfi and compares the cfa rows of its fdes, rax is the assembler to use
+
+rax=${1:-./rax}
+out=$(mktemp)
+
+"$rax" -fauto-cfi test_cfi.asm -o "$out" || exit 1
+
+rows=$(readelf --debug-dump=frames-interp "$out" | awk '/FDE/ { fde = 1; next } fde && $1 ~ /^[0-9a-f]+$/ { print $1, $2 }')
+rm -f "$out"
+
+expected="0000000000000000 rsp+8
+0000000000000001 rsp+16
+0000000000000002 rsp+24
+0000000000000008 rsp+16
+0000000000000009 rsp+8
+000000000000000a rsp+8
+000000000000000b rsp+16
+0000000000000011 rsp+8
+0000000000000012 rsp+16
+0000000000000018 rsp+8"
+
+if [ "$rows" != "$expected" ]
+then
+    printf 'expected:\n%s\ngot:\n%s\n' "$expected" "$rows"
+    exit 1
+fi
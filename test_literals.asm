@@ -0,0 +1,52 @@
+; labels right behind a literal keep their distance to it when identical literals are shared,
+; main returns 0 when built with -fdedup-literals and -fmerge-constants in any combination
+
+global main
+
+section .rodata
+x:
+        dd 1, 2
+k:
+        dd 9
+y:
+        dd 1, 2
+y_end:
+        dd 3
+z:
+        dd 1, 2
+w:
+        db "hi", 0
+w2:
+        db "hi", 0
+w2_end:
+        align 16
+v:
+        dd 1, 2
+
+section .data
+d:
+        dd y_end - y
+e:
+        dd w2_end - w2
+pv:
+        dq v
+
+section .text
+main:
+        mov     eax, [rel d]
+        cmp     eax, 8
+        jne     fail
+        mov     eax, [rel e]
+        cmp     eax, 3
+        jne     fail
+        mov     rax, [rel pv]
+        mov     ecx, [rax + 4]
+        cmp     ecx, 2
+        jne     fail
+        and     eax, 15
+        jne     fail
+        mov     eax, 0
+        ret
+fail:
+        mov     eax, 1
+        ret